@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <iostream>
+#include <algorithm>
 #include "btree.h"
+#include "crc32c.h"
 
 KeyValuePair::KeyValuePair()
 {}
@@ -28,10 +30,12 @@ KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 BTreeIndex::BTreeIndex(SIZE_T keysize,
                        SIZE_T valuesize,
                        BufferCache *cache,
-                       bool unique)
+                       bool unique,
+                       SIZE_T flags)
 {
     superblock.info.keysize=keysize;
     superblock.info.valuesize=valuesize;
+    superblock.info.flags=flags;
     buffercache=cache;
     // note: ignoring unique now
 }
@@ -50,6 +54,7 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
     buffercache=rhs.buffercache;
     superblock_index=rhs.superblock_index;
     superblock=rhs.superblock;
+    ops=rhs.ops;
 }
 
 BTreeIndex::~BTreeIndex()
@@ -64,21 +69,25 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 }
 
 
+//
+// Free blocks are found in the disk's allocation bitmap rather than
+// in a list kept inside them, so a freed block is never written again
+// and, on a -punch disk, stays a hole.  superblock.info.freelist is
+// where to start looking: every block before it is in use.
+//
 ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 {
     n=superblock.info.freelist;
     
-    if (n==0) {
-        return ERROR_NOSPACE;
+    while (n<buffercache->GetNumBlocks() && buffercache->IsBlockAllocated(n)) {
+        n++;
     }
     
-    BTreeNode node;
-    
-    node.Unserialize(buffercache,n);
-    
-    assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+    if (n>=buffercache->GetNumBlocks()) {
+        return ERROR_NOSPACE;
+    }
     
-    superblock.info.freelist=node.info.freelist;
+    superblock.info.freelist=n+1;
     
     superblock.Serialize(buffercache,superblock_index);
     
@@ -90,19 +99,11 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
-    BTreeNode node;
-    
-    node.Unserialize(buffercache,n);
-    
-    assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
-    
-    node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+    assert(buffercache->IsBlockAllocated(n));
     
-    node.info.freelist=superblock.info.freelist;
-    
-    node.Serialize(buffercache,n);
-    
-    superblock.info.freelist=n;
+    if (n<superblock.info.freelist) {
+        superblock.info.freelist=n;
+    }
     
     superblock.Serialize(buffercache,superblock_index);
     
@@ -120,17 +121,80 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     assert(superblock_index==0);
     
     if (create) {
-        // build a super block, root node, and a free space list
+        // Node headers keep key lengths in 16 bits
+        if (superblock.info.keysize > 65535) {
+            return ERROR_SIZE;
+        }
+        // Integer keys are 8 bytes, and interpolation needs them
+        if (superblock.info.flags & BTREE_INTKEYS) {
+            if (superblock.info.keysize != 8) {
+                return ERROR_SIZE;
+            }
+            if (superblock.info.flags & BTREE_VARLEN) {
+                return ERROR_BADCONFIG;
+            }
+        } else if (superblock.info.flags & BTREE_INTERPOLATE) {
+            return ERROR_BADCONFIG;
+        }
+        // Logged values have to fit in a log block, after its live
+        // count, and their lengths in a ValueRef
+        SIZE_T leafvaluesize = superblock.info.valuesize;
+        if (superblock.info.flags & BTREE_VALUELOG) {
+            if (superblock.info.valuesize > 65535 ||
+                superblock.info.valuesize > buffercache->GetBlockSize() - sizeof(NodeHeader) - sizeof(SIZE_T)) {
+                return ERROR_SIZE;
+            }
+            leafvaluesize = sizeof(ValueRef);
+        }
+        if (superblock.info.flags & BTREE_VARLEN) {
+            // Slot offsets have to fit in a SLOT_T, and a split has to
+            // be able to leave both halves within a node
+            SIZE_T capacity = BTreeNode::SlottedCapacity(buffercache->GetBlockSize());
+            if (buffercache->GetBlockSize() > 65536 ||
+                4 * BTreeNode::CellBytes(BTREE_LEAF_NODE,
+                                         superblock.info.keysize,
+                                         leafvaluesize) > capacity ||
+                4 * BTreeNode::CellBytes(BTREE_INTERIOR_NODE,
+                                         superblock.info.keysize, 0) > capacity) {
+                return ERROR_SIZE;
+            }
+        }
+        
+        SIZE_T bloomblocks=0;
+        if (superblock.info.flags & BTREE_BLOOM) {
+            bloomblocks=buffercache->GetNumBlocks()/BTREE_BLOOM_FRACTION;
+            if (bloomblocks==0) {
+                bloomblocks=1;
+            }
+            if (superblock_index+2+bloomblocks>=buffercache->GetNumBlocks()) {
+                return ERROR_NOSPACE;
+            }
+        }
+        SIZE_T firstfree=superblock_index+2+bloomblocks;
+        
+        // Whatever an earlier tree on this disk left allocated is free
+        // now; free blocks are only tracked in the bitmap
+        for (SIZE_T i=superblock_index+1; i<buffercache->GetNumBlocks(); i++) {
+            if (buffercache->IsBlockAllocated(i)) {
+                buffercache->NotifyDeallocateBlock(i);
+            }
+        }
+        
+        // build a super block, root node, and the Bloom filter
         //
         // Superblock at superblock_index
         // root node at superblock_index+1
-        // free space list for rest
+        // Bloom filter blocks, if any, after that
+        // the rest is free
         BTreeNode newsuperblock(BTREE_SUPERBLOCK,
                                 superblock.info.keysize,
                                 superblock.info.valuesize,
-                                buffercache->GetBlockSize());
+                                buffercache->GetBlockSize(),
+                                superblock.info.flags);
         newsuperblock.info.rootnode=superblock_index+1;
-        newsuperblock.info.freelist=superblock_index+2;
+        newsuperblock.info.freelist=firstfree;
+        newsuperblock.info.bloom=bloomblocks ? superblock_index+2 : 0;
+        newsuperblock.info.bloomblocks=bloomblocks;
         newsuperblock.info.numkeys=0;
         
         buffercache->NotifyAllocateBlock(superblock_index);
@@ -144,9 +208,9 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
         BTreeNode newrootnode(BTREE_ROOT_NODE,
                               superblock.info.keysize,
                               superblock.info.valuesize,
-                              buffercache->GetBlockSize());
+                              buffercache->GetBlockSize(),
+                              superblock.info.flags);
         newrootnode.info.rootnode=superblock_index+1;
-        newrootnode.info.freelist=superblock_index+2;
         newrootnode.info.numkeys=0;
         
         buffercache->NotifyAllocateBlock(superblock_index+1);
@@ -157,35 +221,229 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
             return rc;
         }
         
-        for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) {
-            BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-                                  superblock.info.keysize,
-                                  superblock.info.valuesize,
-                                  buffercache->GetBlockSize());
-            newfreenode.info.rootnode=superblock_index+1;
-            newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
+        for (SIZE_T i=superblock_index+2; i<firstfree; i++) {
+            BTreeNode newbloomblock(BTREE_BLOOM_BLOCK,
+                                    superblock.info.keysize,
+                                    superblock.info.valuesize,
+                                    buffercache->GetBlockSize(),
+                                    superblock.info.flags);
+            // Nothing in the filter yet
+            memset(newbloomblock.data,0,newbloomblock.info.GetNumDataBytes());
+            
+            buffercache->NotifyAllocateBlock(i);
             
-            rc = newfreenode.Serialize(buffercache,i);
+            rc=newbloomblock.Serialize(buffercache,i);
             
             if (rc) {
                 return rc;
             }
-            
         }
     }
     
     // OK, now, mounting the btree is simply a matter of reading the superblock
     
-    return superblock.Unserialize(buffercache,initblock);
+    rc=superblock.Unserialize(buffercache,initblock);
+    if (rc) {
+        return rc;
+    }
+    
+    // Every node has the superblock's key and value size, so the
+    // specialized node code can be chosen once for the whole index
+    ops.Init(superblock.info.keysize, superblock.info.valuesize, superblock.info.flags);
+    
+    return ERROR_NOERROR;
 }
 
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
+    if (superblock.info.nodetype != BTREE_SUPERBLOCK) {
+        // Never attached (or the attach failed)
+        return ERROR_NOTANINDEX;
+    }
     return superblock.Serialize(buffercache,superblock_index);
 }
 
 
+//
+// Value log (BTREE_VALUELOG): stored is the ValueRef a leaf holds
+//
+ERROR_T BTreeIndex::AppendToLog(const VALUE_T &value, VALUE_T &stored)
+{
+    ERROR_T rc;
+    BTreeNode log(BTREE_LOG_BLOCK,
+                  superblock.info.keysize,
+                  superblock.info.valuesize,
+                  buffercache->GetBlockSize(),
+                  superblock.info.flags);
+    SIZE_T block = superblock.info.valuelog;
+    SIZE_T live = 0;
+    
+    if (block) {
+        rc = log.Unserialize(buffercache, block, &superblock.info);
+        if (rc) {  return rc; }
+        memcpy(&live, log.data, sizeof(live));
+        if (log.info.numkeys + value.length > log.info.GetNumDataBytes()) {
+            // Full; the rest of it stays unused, and the block goes
+            // once its last value is released
+            block = 0;
+            live = 0;
+            memset(log.data, 0, log.info.GetNumDataBytes());
+        }
+    }
+    if (!block) {
+        // Start a new log block
+        rc = AllocateNode(block);
+        if (rc) {  return rc; }
+        superblock.info.valuelog = block;
+        rc = superblock.Serialize(buffercache, superblock_index);
+        if (rc) {  return rc; }
+        log.info.numkeys = sizeof(live);
+    }
+    
+    ValueRef ref;
+    ref.block = block;
+    ref.offset = log.info.numkeys;
+    ref.length = value.length;
+    memcpy(log.data + ref.offset, value.data, value.length);
+    log.info.numkeys += value.length;
+    live++;
+    memcpy(log.data, &live, sizeof(live));
+    rc = log.Serialize(buffercache, block);
+    if (rc) {  return rc; }
+    
+    stored.Resize(sizeof(ref), false);
+    memcpy(stored.data, &ref, sizeof(ref));
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::ReadFromLog(const VALUE_T &stored, VALUE_T &value) const
+{
+    ValueRef ref;
+    BTreeNode log;
+    
+    memcpy(&ref, stored.data, sizeof(ref));
+    ERROR_T rc = log.View(buffercache, ref.block, &superblock.info);
+    if (rc) {  return rc; }
+    if (log.info.nodetype != BTREE_LOG_BLOCK) {
+        return ERROR_INSANE;
+    }
+    if (value.length != ref.length) {
+        value.Resize(ref.length, false);
+    }
+    memcpy(value.data, log.data + ref.offset, ref.length);
+    return ERROR_NOERROR;
+}
+
+//
+// Replace the value stored refers to: in place if it is the same
+// size, otherwise appended, in which case stored changes and the old
+// ref is the caller's to release once no leaf points to it
+//
+ERROR_T BTreeIndex::WriteToLog(const VALUE_T &value, VALUE_T &stored)
+{
+    ValueRef ref;
+    BTreeNode log;
+    
+    memcpy(&ref, stored.data, sizeof(ref));
+    if (value.length != ref.length) {
+        return AppendToLog(value, stored);
+    }
+    ERROR_T rc = log.View(buffercache, ref.block, &superblock.info, true);
+    if (rc) {  return rc; }
+    memcpy(log.data + ref.offset, value.data, value.length);
+    return ERROR_NOERROR;
+}
+
+//
+// No leaf refers to the value stored refers to any more
+//
+ERROR_T BTreeIndex::ReleaseFromLog(const VALUE_T &stored)
+{
+    ValueRef ref;
+    BTreeNode log;
+    SIZE_T live;
+    
+    memcpy(&ref, stored.data, sizeof(ref));
+    ERROR_T rc = log.Unserialize(buffercache, ref.block, &superblock.info);
+    if (rc) {  return rc; }
+    if (log.info.nodetype != BTREE_LOG_BLOCK) {
+        return ERROR_INSANE;
+    }
+    memcpy(&live, log.data, sizeof(live));
+    if (live == 0) {
+        return ERROR_INSANE;
+    }
+    live--;
+    if (live == 0) {
+        if (ref.block != superblock.info.valuelog) {
+            return DeallocateNode(ref.block);
+        }
+        // Still the block we append to, so it starts over instead
+        log.info.numkeys = sizeof(live);
+    }
+    memcpy(log.data, &live, sizeof(live));
+    return log.Serialize(buffercache, ref.block);
+}
+
+
+//
+// Bloom filter (BTREE_BLOOM): all of a key's bits are in one filter
+// block, so checking or adding a key touches just that block.  Which
+// block, and bits gets which bits in it.
+//
+SIZE_T BTreeIndex::BloomBits(const KEY_T &key, SIZE_T bits[BTREE_BLOOM_PROBES]) const
+{
+    CRC_T hash = Crc32c((const BYTE_T *) key.data, key.length);
+    SIZE_T mixed = hash * 2654435761U;
+    SIZE_T step = (mixed >> 16) | 1;
+    SIZE_T numbits = (buffercache->GetBlockSize() - sizeof(NodeHeader)) * 8;
+    
+    for (SIZE_T i = 0; i < BTREE_BLOOM_PROBES; i++) {
+        bits[i] = (mixed + i * step) % numbits;
+    }
+    return superblock.info.bloom + hash % superblock.info.bloomblocks;
+}
+
+//
+// false only if key (as the nodes keep it) was never inserted
+//
+bool BTreeIndex::BloomMayContain(const KEY_T &key) const
+{
+    SIZE_T bits[BTREE_BLOOM_PROBES];
+    BTreeNode filter;
+    
+    if (!(superblock.info.flags & BTREE_BLOOM)) {
+        return true;
+    }
+    if (filter.View(buffercache, BloomBits(key, bits), &superblock.info) != ERROR_NOERROR) {
+        // Can't tell, so the tree has to
+        return true;
+    }
+    for (SIZE_T i = 0; i < BTREE_BLOOM_PROBES; i++) {
+        if (!(filter.data[bits[i] / 8] & (1 << (bits[i] % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ERROR_T BTreeIndex::BloomAdd(const KEY_T &key)
+{
+    SIZE_T bits[BTREE_BLOOM_PROBES];
+    BTreeNode filter;
+    
+    if (!(superblock.info.flags & BTREE_BLOOM)) {
+        return ERROR_NOERROR;
+    }
+    ERROR_T rc = filter.View(buffercache, BloomBits(key, bits), &superblock.info, true);
+    if (rc) {  return rc; }
+    for (SIZE_T i = 0; i < BTREE_BLOOM_PROBES; i++) {
+        filter.data[bits[i] / 8] |= 1 << (bits[i] % 8);
+    }
+    return ERROR_NOERROR;
+}
+
 ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
                                            const BTreeOp op,
                                            const KEY_T &key,
@@ -194,11 +452,10 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
     BTreeNode b;
     ERROR_T rc;
     SIZE_T offset;
-    KEY_T testkey;
     SIZE_T ptr;
-    rc= b.Unserialize(buffercache,node);
-    // cout << "\n Now looking at node " << node << "\n";
-    // cout << "\nCalling lookuporupdate now with " << op << "and nodetype " << b.info.nodetype << "and numkeys " << b.info.numkeys << "\n";
+    // Only this node is touched before we move on to the child, so a
+    // view straight into the cache is enough
+    rc= b.View(buffercache,node,&superblock.info);
     if (rc!=ERROR_NOERROR) {
         return rc;
     }
@@ -206,54 +463,41 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
     switch (b.info.nodetype) {
         case BTREE_ROOT_NODE:
         case BTREE_INTERIOR_NODE:
-            // Scan through key/ptr pairs
-            //and recurse if possible
-            for (offset=0;offset<b.info.numkeys;offset++) {
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (key<testkey) {
-                    // OK, so we now have the first key that's larger
-                    // so we ned to recurse on the ptr immediately previous to
-                    // this one, if it exists
-                    rc=b.GetPtr(offset,ptr);
-                    
-                    if (rc) { return rc; }
-                    return LookupOrUpdateInternal(ptr,op,key,value);
-                }  else if (key == testkey) {
-                    offset++;
-                    rc=b.GetPtr(offset,ptr);
-                    
-                    if (rc) { return rc; }
-                    return LookupOrUpdateInternal(ptr,op,key,value);
-                }
-            }
-            // if we got here, we need to go to the next pointer, if it exists
-            if (b.info.numkeys>0) {
-                rc=b.GetPtr(b.info.numkeys,ptr);
-                if (rc) { return rc; }
-                return LookupOrUpdateInternal(ptr,op,key,value);
-            } else {
+            if (b.info.numkeys==0) {
                 // There are no keys at all on this node, so nowhere to go
                 return ERROR_NONEXISTENT;
             }
+            // A separator is the first key of its right subtree, so we
+            // follow the pointer after the last key that is <= key
+            offset=b.UpperBound(key,&ops);
+            rc=b.GetPtr(offset,ptr,&ops);
+            if (rc) { return rc; }
+            return LookupOrUpdateInternal(ptr,op,key,value);
             break;
         case BTREE_LEAF_NODE:
-            // Scan through keys looking for matching value
-            for (offset=0;offset<b.info.numkeys;offset++) {
-                rc=b.GetKey(offset,testkey);
-                if (rc) {  return rc; }
-                if (testkey==key) {
-                    if (op==BTREE_OP_LOOKUP) {
-                        return b.GetVal(offset,value);
-                    } else {
-                        //This should be the update code
-                        rc = b.SetVal(offset, value);
-                        if (rc){ return rc; }
-                        return b.Serialize(buffercache, node);
-                    }
+            offset=b.LowerBound(key,&ops);
+            if (offset==b.info.numkeys || b.CompareKey(offset,key)!=0) {
+                return ERROR_NONEXISTENT;
+            }
+            if (superblock.info.flags & BTREE_VALUELOG) {
+                VALUE_T stored;
+                rc = b.GetVal(offset,stored,&ops);
+                if (rc) { return rc; }
+                if (op==BTREE_OP_LOOKUP) {
+                    return ReadFromLog(stored,value);
                 }
+                // Same size (this isn't a BTREE_VARLEN index), so the
+                // leaf keeps its ValueRef
+                return WriteToLog(value,stored);
+            }
+            if (op==BTREE_OP_LOOKUP) {
+                return b.GetVal(offset,value,&ops);
+            } else {
+                // Same (cached) block again, this time writable in place
+                rc = b.View(buffercache, node, &superblock.info, true);
+                if (rc){ return rc; }
+                return b.SetVal(offset, value, &ops);
             }
-            return ERROR_NONEXISTENT;
             break;
         default:
             // We can't be looking at anything other than a root, internal, or leaf
@@ -265,7 +509,7 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+ERROR_T BTreeIndex::PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt) const
 {
     KEY_T key;
     VALUE_T value;
@@ -273,6 +517,7 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
     SIZE_T offset;
     ERROR_T rc;
     unsigned i;
+    SIZE_T len;
     
     if (dt==BTREE_DEPTH_DOT) {
         os << nodenum << " [ label=\""<<nodenum<<": ";
@@ -298,7 +543,14 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
                     if (offset==b.info.numkeys) break;
                     rc=b.GetKey(offset,key);
                     if (rc) {  return rc; }
-                    for (i=0;i<b.info.keysize;i++) {
+                    // Separators are truncated, so leave off the padding
+                    if (b.info.flags & BTREE_INTKEYS) {
+                        BTreeNode::SwapIntKey(key);
+                        len = key.length;
+                    } else {
+                        len = b.IsSlotted() ? key.length : BTreeNode::SignificantLength(key,b.info.keysize);
+                    }
+                    for (i=0;i<len;i++) {
                         os << key.data[i];
                     }
                     os << " ";
@@ -324,7 +576,10 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
                 }
                 rc=b.GetKey(offset,key);
                 if (rc) {  return rc; }
-                for (i=0;i<b.info.keysize;i++) {
+                if (b.info.flags & BTREE_INTKEYS) {
+                    BTreeNode::SwapIntKey(key);
+                }
+                for (i=0;i<key.length;i++) {
                     os << key.data[i];
                 }
                 if (dt==BTREE_SORTED_KEYVAL) {
@@ -334,7 +589,12 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
                 }
                 rc=b.GetVal(offset,value);
                 if (rc) {  return rc; }
-                for (i=0;i<b.info.valuesize;i++) {
+                if (b.info.flags & BTREE_VALUELOG) {
+                    VALUE_T stored(value);
+                    rc=ReadFromLog(stored,value);
+                    if (rc) {  return rc; }
+                }
+                for (i=0;i<value.length;i++) {
                     os << value.data[i];
                 }
                 if (dt==BTREE_SORTED_KEYVAL) {
@@ -357,392 +617,1546 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
     return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+//
+// key as the nodes keep it: integer keys come in big-endian and are
+// kept as native integers
+//
+const KEY_T & BTreeIndex::InternalKey(const KEY_T &key, KEY_T &scratch) const
 {
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+    if (!(superblock.info.flags & BTREE_INTKEYS)) {
+        return key;
+    }
+    scratch = key;
+    BTreeNode::SwapIntKey(scratch);
+    return scratch;
 }
 
-SIZE_T BTreeIndex::NumSlots(const SIZE_T &node){
-    ERROR_T rc;
-    BTreeNode b;
+//
+// Keys are exactly keysize bytes, or at most that in a BTREE_VARLEN
+// index
+//
+static bool RightKeySize(const NodeMetadata &info, const KEY_T &key)
+{
+    if (info.flags & BTREE_VARLEN) {
+        return key.length <= info.keysize;
+    }
+    return key.length == info.keysize;
+}
+
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+    KEY_T scratch;
     
-    rc = b.Unserialize(buffercache, node);
-    // cout << "\n In numslots nodetype " << b.info.nodetype << "\n";
-    switch(b.info.nodetype){
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:
-            return b.info.GetNumSlotsAsInterior();
-        case BTREE_LEAF_NODE:
-            // cout << "\nNumSlots went to leaf (GOOD)\n";
-            return b.info.GetNumSlotsAsLeaf();
-        default:
-            // cout << "\nNumSlots went to default (BAD)\n";
-            return 0;
+    if (!RightKeySize(superblock.info, key)) {
+        return ERROR_NONEXISTENT;
+    }
+    const KEY_T &internal = InternalKey(key, scratch);
+    if (!BloomMayContain(internal)) {
+        return ERROR_NONEXISTENT;
     }
+    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, internal, value);
 }
 
-bool BTreeIndex::IsFull(const SIZE_T &node)
+//
+// Orders a batch (by index) by key, as the nodes order them
+//
+struct BatchOrder {
+    const vector<KeyValuePair> *batch;
+    SIZE_T flags;
+    
+    BatchOrder(const vector<KeyValuePair> &b, SIZE_T f) : batch(&b), flags(f) {}
+    bool operator()(SIZE_T a, SIZE_T b) const {
+        return BTreeNode::CompareKeys((*batch)[a].key, (*batch)[b].key, flags) < 0;
+    }
+};
+
+//
+// Keys [first,last) of a sorted batch that go through node
+//
+struct BatchVisit {
+    SIZE_T node;
+    SIZE_T first;
+    SIZE_T last;
+    
+    BatchVisit(SIZE_T n, SIZE_T f, SIZE_T l) : node(n), first(f), last(l) {}
+    bool operator<(const BatchVisit &rhs) const { return node < rhs.node; }
+};
+
+ERROR_T BTreeIndex::LookupBatch(const vector<KEY_T> &keys,
+                                vector<VALUE_T> &values,
+                                vector<ERROR_T> &results)
 {
+    vector<KeyValuePair> batch; // the keys that can be there, as the nodes keep them
+    vector<SIZE_T> origin;
+    KEY_T scratch;
     ERROR_T rc;
-    BTreeNode b;
     
-    rc = b.Unserialize(buffercache, node);
-    switch(b.info.nodetype){
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:
-            if(b.info.GetNumSlotsAsInterior() == b.info.numkeys){
-                return true;
-            } else{
-                return false;
-            }
-        case BTREE_LEAF_NODE:
-            if(b.info.GetNumSlotsAsLeaf() == b.info.numkeys){
-                return true;
-            } else{
-                return false;
+    values.assign(keys.size(), VALUE_T());
+    results.assign(keys.size(), ERROR_NONEXISTENT);
+    for (SIZE_T i = 0; i < keys.size(); i++) {
+        if (RightKeySize(superblock.info, keys[i]) && BloomMayContain(InternalKey(keys[i], scratch))) {
+            batch.push_back(KeyValuePair(InternalKey(keys[i], scratch), VALUE_T()));
+            origin.push_back(i);
+        }
+    }
+    vector<SIZE_T> byKey(batch.size());
+    for (SIZE_T i = 0; i < byKey.size(); i++) {
+        byKey[i] = i;
+    }
+    sort(byKey.begin(), byKey.end(), BatchOrder(batch, superblock.info.flags));
+    
+    // One level at a time, each node once, in block order
+    vector<BatchVisit> level, next;
+    if (!byKey.empty()) {
+        level.push_back(BatchVisit(superblock.info.rootnode, 0, byKey.size()));
+    }
+    while (!level.empty()) {
+        sort(level.begin(), level.end());
+        next.clear();
+        for (SIZE_T v = 0; v < level.size(); v++) {
+            BTreeNode b;
+            rc = b.View(buffercache, level[v].node, &superblock.info);
+            if (rc) {  return rc; }
+            
+            if (b.info.nodetype == BTREE_ROOT_NODE || b.info.nodetype == BTREE_INTERIOR_NODE) {
+                if (b.info.numkeys == 0) {
+                    // Empty tree
+                    continue;
+                }
+                // Sorted keys go to the children in runs
+                SIZE_T j = level[v].first;
+                while (j < level[v].last) {
+                    SIZE_T offset = b.UpperBound(batch[byKey[j]].key, &ops);
+                    SIZE_T end = j + 1;
+                    while (end < level[v].last && b.UpperBound(batch[byKey[end]].key, &ops) == offset) {
+                        end++;
+                    }
+                    SIZE_T child;
+                    rc = b.GetPtr(offset, child, &ops);
+                    if (rc) {  return rc; }
+                    next.push_back(BatchVisit(child, j, end));
+                    j = end;
+                }
+            } else if (b.info.nodetype == BTREE_LEAF_NODE) {
+                for (SIZE_T j = level[v].first; j < level[v].last; j++) {
+                    SIZE_T i = origin[byKey[j]];
+                    SIZE_T offset = b.LowerBound(batch[byKey[j]].key, &ops);
+                    if (offset == b.info.numkeys || b.CompareKey(offset, batch[byKey[j]].key) != 0) {
+                        continue;
+                    }
+                    rc = b.GetVal(offset, values[i], &ops);
+                    if (rc) {  return rc; }
+                    results[i] = ERROR_NOERROR;
+                }
+                // Reading the log can evict the leaf, so that waits
+                // until we're done with it
+                if (superblock.info.flags & BTREE_VALUELOG) {
+                    for (SIZE_T j = level[v].first; j < level[v].last; j++) {
+                        SIZE_T i = origin[byKey[j]];
+                        if (results[i] == ERROR_NOERROR) {
+                            VALUE_T stored(values[i]);
+                            rc = ReadFromLog(stored, values[i]);
+                            if (rc) {  return rc; }
+                        }
+                    }
+                }
+            } else {
+                return ERROR_INSANE;
             }
-        default:
-            return false;
+        }
+        level.swap(next);
+    }
+    return ERROR_NOERROR;
+}
+
+//
+// Keys and values are exactly keysize and valuesize bytes, or at most
+// that in a BTREE_VARLEN index
+//
+static bool RightSize(const NodeMetadata &info, const KEY_T &key, const VALUE_T &value)
+{
+    if (info.flags & BTREE_VARLEN) {
+        return RightKeySize(info, key) && value.length <= info.valuesize;
     }
+    return RightKeySize(info, key) && value.length == info.valuesize;
 }
 
 ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+    KEY_T scratch;
+    
+    if (!RightSize(superblock.info, key, value)) {
+        return ERROR_SIZE;
+    }
+    const KEY_T &internal = InternalKey(key, scratch);
+    ERROR_T rc = InsertOrUpdate(KeyValuePair(internal, value), BTREE_OP_INSERT);
+    if (rc) {  return rc; }
+    return BloomAdd(internal);
+}
+
+//
+// Insert, or update in a way that may need a split (a value changing
+// size), growing the tree by a level if the root splits
+//
+ERROR_T BTreeIndex::InsertOrUpdate(const KeyValuePair &keyVal, const BTreeOp op, VALUE_T *replaced)
 {
     SIZE_T root = superblock.info.rootnode;
     ERROR_T rc;
-    KeyValuePair keyVal(key, value);
     BTreeNode rootnode;
     
-    rc = rootnode.Unserialize(buffercache, root);
+    rc = rootnode.Unserialize(buffercache, root, &superblock.info);
     if (rc) {  return rc; }
     
-    if(IsFull(root)){
-        // cout << "\n ROOT IS FULL!!!!!!\n";
-        
-        SIZE_T newRootNodeAddress;
-        BTreeNode newrootnode(BTREE_ROOT_NODE,
-                              superblock.info.keysize,
-                              superblock.info.valuesize,
-                              buffercache->GetBlockSize());
-        
-        rc = AllocateNode(newRootNodeAddress);
+    if(rootnode.info.numkeys == 0){
+        if (op == BTREE_OP_UPDATE) {
+            return ERROR_NONEXISTENT;
+        }
+        //Root node first insertion: two empty leaves split at this key
+        SIZE_T firstChildAddress;
+        SIZE_T secondChildAddress;
+        BTreeNode firstchildnode(BTREE_LEAF_NODE,
+                                 superblock.info.keysize,
+                                 superblock.info.valuesize,
+                                 buffercache->GetBlockSize(),
+                                 superblock.info.flags);
+        rc = AllocateNode(firstChildAddress);
         if (rc) {  return rc; }
-        // cout << "\n Allocated new root at address " << newRootNodeAddress << "\n";
-        newrootnode.info.rootnode = newRootNodeAddress;
-        superblock.info.rootnode = newRootNodeAddress;
         
-        rc = superblock.Serialize(buffercache, superblock_index);
+        BTreeNode secondchildnode(BTREE_LEAF_NODE,
+                                  superblock.info.keysize,
+                                  superblock.info.valuesize,
+                                  buffercache->GetBlockSize(),
+                                  superblock.info.flags);
+        rc = AllocateNode(secondChildAddress);
         if (rc) {  return rc; }
         
-        newrootnode.info.numkeys=0;
-        rootnode.info.nodetype = BTREE_INTERIOR_NODE;
-        rootnode.info.rootnode = newRootNodeAddress;
-        
-        rc = rootnode.Serialize(buffercache, root);
+        NodeEntries rootentries;
+        rootentries.nodetype = BTREE_ROOT_NODE;
+        rootentries.keys.push_back(keyVal.key);
+        rootentries.ptrs.push_back(firstChildAddress);
+        rootentries.ptrs.push_back(secondChildAddress);
+        rc = rootnode.Pack(rootentries, 0, 0);
         if (rc) {  return rc; }
-        rc = newrootnode.SetPtr(0, root);
+        rc = firstchildnode.SetPtr(0, secondChildAddress);
         if (rc) {  return rc; }
-        rc = newrootnode.Serialize(buffercache, newRootNodeAddress);
+        rc = firstchildnode.Serialize(buffercache, firstChildAddress);
         if (rc) {  return rc; }
-        
-        // cout << "\n Going into splitting child and old root pointer is " << root << '\n';
-        rc = SplitChild(newRootNodeAddress, 0);
+        rc = secondchildnode.Serialize(buffercache, secondChildAddress);
+        if (rc) {  return rc; }
+        rc = rootnode.Serialize(buffercache, root);
         if (rc) {  return rc; }
-        
-        return InsertNonFull(newRootNodeAddress, keyVal);
-    } else {
-        
-        
-        if(rootnode.info.numkeys == 0){
-            SIZE_T firstChildAddress;
-            SIZE_T secondChildAddress;
-            BTreeNode firstchildnode(BTREE_LEAF_NODE,
-                                     superblock.info.keysize,
-                                     superblock.info.valuesize,
-                                     buffercache->GetBlockSize());
-            rc = AllocateNode(firstChildAddress);
-            if (rc) {  return rc; }
-            
-            firstchildnode.info.numkeys = 0;
-            BTreeNode secondchildnode(BTREE_LEAF_NODE,
-                                      superblock.info.keysize,
-                                      superblock.info.valuesize,
-                                      buffercache->GetBlockSize());
-            rc = AllocateNode(secondChildAddress);
-            if (rc) {  return rc; }
-            
-            secondchildnode.info.numkeys = 0;
-            rootnode.info.numkeys++;
-            rc = rootnode.SetPtr(0, firstChildAddress);
-            if (rc) {  return rc; }
-            rc = rootnode.SetPtr(1, secondChildAddress);
-            if (rc) {  return rc; }
-            rootnode.info.numkeys--;
-            rc = firstchildnode.Serialize(buffercache, firstChildAddress);
-            if (rc) {  return rc; }
-            rc = secondchildnode.Serialize(buffercache, secondChildAddress);
-            if (rc) {  return rc; }
-            rc = rootnode.Serialize(buffercache, root);
-            if (rc) {  return rc; }
-            // cout << "\nCreated first child at address " << firstChildAddress << "\n";
-        }
-        
-        return InsertNonFull(root, keyVal);
-        
     }
-}
-
-ERROR_T BTreeIndex::SplitChild(const SIZE_T &parentAddress, const SIZE_T i){
-    ERROR_T rc;
-    BTreeNode parent;
-    BTreeNode leftChild;
-    SIZE_T leftChildAddress;
-    // cout << "\nAt beginning of split with parent " << parentAddress << "\n";
-    rc = parent.Unserialize(buffercache, parentAddress);
-    if (rc) {  return rc; }
-    rc = parent.GetPtr(i, leftChildAddress);
-    if (rc) {  return rc; }
-    rc = leftChild.Unserialize(buffercache, leftChildAddress);
-    if (rc) {  return rc; }
-    // cout << "\nThrough first Unserialize with child address " << leftChildAddress << "\n";
     
-    SIZE_T rightChildAddress;
-    BTreeNode rightChild(BTREE_INTERIOR_NODE,
-                         superblock.info.keysize,
-                         superblock.info.valuesize,
-                         buffercache->GetBlockSize());
-    rc = AllocateNode(rightChildAddress);
-    if (rc) {  return rc; }
-    // cout << "\n right child created with address " << rightChildAddress << "\n";
+    bool split;
+    KEY_T separator;
+    SIZE_T rightAddress;
     
-    rightChild.info.nodetype = leftChild.info.nodetype;
-    rightChild.info.numkeys = (NumSlots(leftChildAddress) + 1)/ 2; // add one in case we are splitting an odd number
+    rc = InsertInternal(root, keyVal, 0, 0, split, separator, rightAddress, op, 0, replaced);
+    if (rc || !split) {  return rc; }
     
-    KEY_T currentKeyVal;
-    VALUE_T currentVal;
-    // cout << "\nAt first for loop with numkeys " << rightChild.info.numkeys << "\n";
-    for(SIZE_T j = 0; j < rightChild.info.numkeys; j++){
-        rc = leftChild.GetKey(j + rightChild.info.numkeys, currentKeyVal);
-        if (rc) {  return rc; }
-        rc = rightChild.SetKey(j, currentKeyVal);
-        if (rc) {  return rc; }
-        if(leftChild.info.nodetype == BTREE_LEAF_NODE){
-            rc = leftChild.GetVal(j + rightChild.info.numkeys, currentVal);
-            if (rc) {  return rc; }
-            rc = rightChild.SetVal(j, currentVal);
-            if (rc) {  return rc; }
-        }
-    }
+    // The root split, so the tree grows a level
+    SIZE_T newRootNodeAddress;
+    BTreeNode newrootnode(BTREE_ROOT_NODE,
+                          superblock.info.keysize,
+                          superblock.info.valuesize,
+                          buffercache->GetBlockSize(),
+                          superblock.info.flags);
+    NodeEntries rootentries;
     
-    SIZE_T currentPtr;
-    if(leftChild.info.nodetype != BTREE_LEAF_NODE){ //If you're not at a leaf node copy the pointers
-        for(SIZE_T j = 0; j <= rightChild.info.numkeys; j++){
-            rc = leftChild.GetPtr(j + rightChild.info.numkeys, currentPtr);
+    rc = AllocateNode(newRootNodeAddress);
+    if (rc) {  return rc; }
+    newrootnode.info.rootnode = newRootNodeAddress;
+    rootentries.nodetype = BTREE_ROOT_NODE;
+    rootentries.keys.push_back(separator);
+    rootentries.ptrs.push_back(root);
+    rootentries.ptrs.push_back(rightAddress);
+    rc = newrootnode.Pack(rootentries, 0, 0);
+    if (rc) {  return rc; }
+    rc = newrootnode.Serialize(buffercache, newRootNodeAddress);
+    if (rc) {  return rc; }
+    
+    superblock.info.rootnode = newRootNodeAddress;
+    return superblock.Serialize(buffercache, superblock_index);
+}
+
+//
+// Insert below node, whose keys all lie in [low, high) (0 meaning
+// unbounded).  Nodes are split on the way back up: if this node had
+// to split, split is set and separator/rightAddress describe the new
+// right sibling, which the caller must link in after node.
+//
+// With BTREE_OP_UPDATE the key must already be there and gets the new
+// value, which may not fit in the leaf if its size changed.
+//
+// If overflow is given (BTREE_BSTAR, below the root), a node that
+// would split instead leaves its entries there, writes nothing, and
+// sets split with a rightAddress of 0: the caller spreads them with a
+// neighbour (see SpreadChild).
+//
+// If an update moves a logged value (BTREE_VALUELOG), replaced gets
+// the old ref, to be released once the tree no longer holds it.
+//
+ERROR_T BTreeIndex::InsertInternal(const SIZE_T &node,
+                                   const KeyValuePair &KeyVal,
+                                   const KEY_T *low,
+                                   const KEY_T *high,
+                                   bool &split,
+                                   KEY_T &separator,
+                                   SIZE_T &rightAddress,
+                                   const BTreeOp op,
+                                   NodeEntries *overflow,
+                                   VALUE_T *replaced)
+{
+    BTreeNode target;
+    NodeEntries entries;
+    SIZE_T num;
+    ERROR_T rc = target.Unserialize(buffercache, node, &superblock.info);
+    if (rc) {  return rc; }
+    
+    split = false;
+    
+    if (target.info.nodetype == BTREE_LEAF_NODE) {
+        num = target.LowerBound(KeyVal.key, &ops);
+        bool found = num < target.info.numkeys && target.CompareKey(num, KeyVal.key) == 0;
+        // What the leaf holds: the value, or where it is in the log
+        const VALUE_T *value = &KeyVal.value;
+        VALUE_T stored;
+        if (op == BTREE_OP_UPDATE) {
+            if (!found) {
+                return ERROR_NONEXISTENT;
+            }
+            if (superblock.info.flags & BTREE_VALUELOG) {
+                rc = target.GetVal(num, stored);
+                if (rc) {  return rc; }
+                VALUE_T old(stored);
+                rc = WriteToLog(KeyVal.value, stored);
+                if (rc) {  return rc; }
+                if (replaced && memcmp(old.data, stored.data, stored.length) != 0) {
+                    *replaced = old;
+                }
+                value = &stored;
+            }
+            rc = target.SetVal(num, *value);
+            if (rc == ERROR_NOERROR) {
+                return target.Serialize(buffercache, node);
+            } else if (rc != ERROR_NOSPACE) {
+                return rc;
+            }
+            rc = target.Unpack(entries);
+            if (rc) {  return rc; }
+            entries.vals[num] = *value;
+        } else {
+            if (found) {
+                //If the key already exists in the tree
+                return ERROR_CONFLICT;
+            }
+            if (superblock.info.flags & BTREE_VALUELOG) {
+                rc = AppendToLog(KeyVal.value, stored);
+                if (rc) {  return rc; }
+                value = &stored;
+            }
+            if (target.HasRoom(KeyVal.key, value->length)) {
+                rc = target.InsertKeyVal(num, KeyValuePair(KeyVal.key, *value));
+                if (rc) {  return rc; }
+                return target.Serialize(buffercache, node);
+            }
+            rc = target.Unpack(entries);
             if (rc) {  return rc; }
-            rc = rightChild.SetPtr(j, currentPtr);
+            entries.keys.insert(entries.keys.begin() + num, KeyVal.key);
+            entries.vals.insert(entries.vals.begin() + num, *value);
+        }
+    } else {
+        num = target.UpperBound(KeyVal.key, &ops);
+        
+        // The child's fences are the separators on either side of it,
+        // or ours where it is at the edge
+        KEY_T childLow, childHigh;
+        if (num > 0) {
+            rc = target.GetKey(num - 1, childLow);
+            if (rc) {  return rc; }
+        }
+        if (num < target.info.numkeys) {
+            rc = target.GetKey(num, childHigh);
             if (rc) {  return rc; }
         }
+        SIZE_T childAddress;
+        rc = target.GetPtr(num, childAddress, &ops);
+        if (rc) {  return rc; }
+        
+        bool childSplit;
+        KEY_T childSeparator;
+        SIZE_T childRight;
+        NodeEntries childEntries;
+        const KEY_T *childLowPtr = num > 0 ? &childLow : low;
+        const KEY_T *childHighPtr = num < target.info.numkeys ? &childHigh : high;
+        rc = InsertInternal(childAddress, KeyVal, childLowPtr, childHighPtr,
+                            childSplit, childSeparator, childRight, op,
+                            superblock.info.flags & BTREE_BSTAR ? &childEntries : 0,
+                            replaced);
+        if (rc || !childSplit) {  return rc; }
+        
+        if (childRight == 0) {
+            rc = target.Unpack(entries);
+            if (rc) {  return rc; }
+            rc = SpreadChild(entries, num, childEntries, low, high);
+            if (rc == ERROR_NOSPACE) {
+                // The child has to split on its own after all
+                BTreeNode child(childEntries.nodetype,
+                                superblock.info.keysize,
+                                superblock.info.valuesize,
+                                buffercache->GetBlockSize(),
+                                superblock.info.flags);
+                rc = SplitNode(childAddress, child, childEntries, childLowPtr, childHighPtr,
+                               childSeparator, childRight);
+                if (rc) {  return rc; }
+                entries.keys.insert(entries.keys.begin() + num, childSeparator);
+                entries.ptrs.insert(entries.ptrs.begin() + num + 1, childRight);
+            } else if (rc) {
+                return rc;
+            }
+        } else if (target.HasRoom(childSeparator)) {
+            rc = target.InsertKeyPtr(num, childSeparator, childRight);
+            if (rc) {  return rc; }
+            return target.Serialize(buffercache, node);
+        } else {
+            rc = target.Unpack(entries);
+            if (rc) {  return rc; }
+            entries.keys.insert(entries.keys.begin() + num, childSeparator);
+            entries.ptrs.insert(entries.ptrs.begin() + num + 1, childRight);
+        }
+        
+        // The separator may just be wider than our slots, in which case
+        // re-encoding with wider slots can still avoid a split
+        rc = target.Pack(entries, low, high);
+        if (rc == ERROR_NOERROR) {
+            return target.Serialize(buffercache, node);
+        } else if (rc != ERROR_NOSPACE) {
+            return rc;
+        }
     }
-    KEY_T promotedKey;
-    rc = rightChild.GetKey(0, promotedKey);
-    if (rc) {  return rc; }
-    parent.info.numkeys++;
     
-    leftChild.info.numkeys = NumSlots(leftChildAddress) / 2;
+    split = true;
+    // Nothing above us on the right and the new entry last: keys are
+    // probably arriving in order
+    bool append = !high && num + 1 == entries.keys.size();
+    if (overflow && !append) {
+        *overflow = entries;
+        rightAddress = 0;
+        return ERROR_NOERROR;
+    }
+    return SplitNode(node, target, entries, low, high, separator, rightAddress, append);
+}
+
+//
+// The shortest key that is > left and <= right: right cut just past
+// the first byte where they differ, zeros after that (or nothing, in a
+// BTREE_VARLEN index)
+//
+KEY_T BTreeIndex::ShortestSeparator(const KEY_T &left, const KEY_T &right) const
+{
+    KEY_T separator(right);
+    SIZE_T len = 0;
     
-    for(SIZE_T j = parent.info.numkeys - 1; j > i; j--){ //Change all of the pointers of the parent to the correct place
-        rc = parent.GetPtr(j, currentPtr);
-        if (rc) {  return rc; }
-        rc = parent.SetPtr(j+1, currentPtr);
-        if (rc) {  return rc; }
+    if (superblock.info.flags & BTREE_INTKEYS) {
+        // Can't truncate a native integer
+        return separator;
+    }
+    if (superblock.info.flags & BTREE_VARLEN) {
+        // left < right, so right is the longer one if left is a prefix of it
+        while (len < left.length && left.data[len] == right.data[len]) {
+            len++;
+        }
+        separator.Resize(len + 1);
+        return separator;
     }
-    // cout << "\nMade it past second for loop\n";
-    rc = parent.SetPtr(i+1, rightChildAddress);
-    if (rc) {  return rc; }
     
-    // cout << "\n Parent numkeys is " << parent.info.numkeys << " and i is " << i << "\n";
-    for(SIZE_T j = parent.info.numkeys - 1; j >= i; j--){ //Then change all of the keys of the parent to the correct place
-        if(j == 0){
-            break;
+    while (len < superblock.info.keysize && left.data[len] == right.data[len]) {
+        len++;
+    }
+    if (len < superblock.info.keysize) {
+        len++;
+    }
+    memset(separator.data + len, 0, superblock.info.keysize - len);
+    return separator;
+}
+
+//
+// Where to split an overfull node: near the middle, but within a small
+// window around it pick the point whose separator is shortest, since
+// it is what goes up into the parent.  In a BTREE_VARLEN index the
+// middle is by bytes, and a point is only taken if both halves fit.
+// The left part gets share of the node rather than half if asked.
+//
+SIZE_T BTreeIndex::ChooseSplit(const NodeEntries &entries, const double share,
+                               const SIZE_T windowfraction) const
+{
+    SIZE_T n = entries.keys.size();
+    bool leaf = entries.nodetype == BTREE_LEAF_NODE;
+    bool varlen = superblock.info.flags & BTREE_VARLEN;
+    vector<SIZE_T> before(n + 1, 0); // bytes of entries [0,k)
+    
+    for (SIZE_T k = 0; k < n; k++) {
+        before[k + 1] = before[k] +
+            (varlen ? BTreeNode::CellBytes(entries.nodetype,
+                                           entries.keys[k].length,
+                                           leaf ? entries.vals[k].length : 0)
+                    : 1);
+    }
+    // Leaves can leave just one entry on the right; interior nodes
+    // need one key there besides the one that goes up
+    SIZE_T last = leaf || n < 3 ? n - 1 : n - 2;
+    SIZE_T mid = 0;
+    while (mid < last && before[mid + 1] <= share * before[n]) {
+        mid++;
+    }
+    if (mid < 1) {
+        mid = 1;
+    }
+    // Integer keys are all the same length, so there's no point looking
+    SIZE_T window = superblock.info.flags & BTREE_INTKEYS ? 0 : n / windowfraction;
+    SIZE_T best = mid;
+    SIZE_T bestlen = superblock.info.keysize + 1;
+    SIZE_T capacity = BTreeNode::SlottedCapacity(buffercache->GetBlockSize());
+    
+    for (SIZE_T d = 0; d <= window; d++) {
+        for (int side = 0; side < 2; side++) {
+            SIZE_T k = side ? mid + d : mid - d;
+            if ((side && d == 0) || d > mid || k < 1 || k > last) {
+                continue;
+            }
+            if (varlen && (before[k] > capacity || before[n] - before[k] > capacity)) {
+                continue;
+            }
+            // Leaves promote a truncated copy of key k, interior nodes
+            // promote key k itself
+            KEY_T separator = leaf ? ShortestSeparator(entries.keys[k - 1], entries.keys[k])
+                                   : entries.keys[k];
+            SIZE_T len = varlen ? separator.length
+                                : BTreeNode::SignificantLength(separator, superblock.info.keysize);
+            if (len < bestlen) {
+                best = k;
+                bestlen = len;
+            }
         }
-        rc = parent.GetKey(j-1, currentKeyVal);
-        if (rc) {  return rc; }
-        rc = parent.SetKey(j, currentKeyVal);
-        if (rc) {  return rc; }
     }
-    // cout << "\nMade it past third for loop\n";
-    parent.SetKey(i, promotedKey);
+    return best;
+}
+
+//
+// Cut entries in two where ChooseSplit says: entries keeps the left
+// part, right gets the rest, and separator is what goes between them
+// in the parent
+//
+void BTreeIndex::DivideEntries(NodeEntries &entries,
+                               NodeEntries &right,
+                               KEY_T &separator,
+                               const double share,
+                               const SIZE_T windowfraction) const
+{
+    SIZE_T keep = ChooseSplit(entries, share, windowfraction);
     
-    rc=parent.Serialize(buffercache, parentAddress);
+    right.nodetype = entries.nodetype;
+    right.link = 0;
+    right.keys.clear();
+    right.vals.clear();
+    right.ptrs.clear();
+    
+    if (entries.nodetype == BTREE_LEAF_NODE) {
+        // Right gets [keep,n); what goes up is the shortest key that
+        // separates it from the left half
+        right.keys.assign(entries.keys.begin() + keep, entries.keys.end());
+        right.vals.assign(entries.vals.begin() + keep, entries.vals.end());
+        separator = ShortestSeparator(entries.keys[keep - 1], entries.keys[keep]);
+        entries.keys.resize(keep);
+        entries.vals.resize(keep);
+    } else {
+        // Key keep moves up; right gets the keys after it and the
+        // pointers around them
+        separator = entries.keys[keep];
+        right.keys.assign(entries.keys.begin() + keep + 1, entries.keys.end());
+        right.ptrs.assign(entries.ptrs.begin() + keep + 1, entries.ptrs.end());
+        entries.keys.resize(keep);
+        entries.ptrs.resize(keep + 1);
+    }
+}
+
+//
+// entries is node's content plus one entry too many.  Keep the first
+// half in node, move the rest to a new right sibling, and re-encode
+// both against their new fences.  If append, node is the rightmost on
+// its level and the new entry is its last, so node keeps
+// BTREE_APPEND_FILL of it instead of half.
+//
+ERROR_T BTreeIndex::SplitNode(const SIZE_T &node,
+                              BTreeNode &target,
+                              NodeEntries &entries,
+                              const KEY_T *low,
+                              const KEY_T *high,
+                              KEY_T &separator,
+                              SIZE_T &rightAddress,
+                              const bool append)
+{
+    ERROR_T rc;
+    NodeEntries right;
+    
+    // A root that splits becomes an ordinary interior node
+    if (entries.nodetype == BTREE_ROOT_NODE) {
+        entries.nodetype = BTREE_INTERIOR_NODE;
+    }
+    DivideEntries(entries, right, separator, append ? BTREE_APPEND_FILL : 0.5);
+    
+    rc = AllocateNode(rightAddress);
     if (rc) {  return rc; }
-    rc=leftChild.Serialize(buffercache, leftChildAddress);
+    // The new leaf goes into the chain just after this one
+    if (entries.nodetype == BTREE_LEAF_NODE) {
+        right.link = entries.link;
+        entries.link = rightAddress;
+    }
+    
+    BTreeNode rightnode(right.nodetype,
+                        superblock.info.keysize,
+                        superblock.info.valuesize,
+                        buffercache->GetBlockSize(),
+                        superblock.info.flags);
+    rc = rightnode.Pack(right, &separator, high);
     if (rc) {  return rc; }
-    rc=rightChild.Serialize(buffercache, rightChildAddress);
+    rc = target.Pack(entries, low, &separator);
     if (rc) {  return rc; }
     
-    return rc;
+    rc = target.Serialize(buffercache, node);
+    if (rc) {  return rc; }
+    return rightnode.Serialize(buffercache, rightAddress);
 }
 
-ERROR_T BTreeIndex::InsertNonFull(const SIZE_T &node, const KeyValuePair &KeyVal) {
-    BTreeNode target;
-    ERROR_T rc = target.Unserialize(buffercache, node);
-    if (rc) {  return rc; }
+//
+// BTREE_BSTAR: child, ptr num of parent (whose keys lie in [low,
+// high)), is one entry over full.  Rather than give it a sibling of
+// its own, share its entries with a neighbour that has room, which
+// only moves the separator between them; if neither has, the child
+// and its right (or left) neighbour split 2-to-3, each keeping about
+// two thirds.  parent gets the new separators and pointer, for the
+// caller to write or split.  The children are written; on
+// ERROR_NOSPACE nothing is and the child must split as usual.
+//
+ERROR_T BTreeIndex::SpreadChild(NodeEntries &parent,
+                                const SIZE_T num,
+                                NodeEntries &child,
+                                const KEY_T *low,
+                                const KEY_T *high)
+{
+    ERROR_T rc;
+    bool leaf = child.nodetype == BTREE_LEAF_NODE;
+    BTreeNode first(child.nodetype,
+                    superblock.info.keysize,
+                    superblock.info.valuesize,
+                    buffercache->GetBlockSize(),
+                    superblock.info.flags);
+    BTreeNode second(first), third(first);
+    NodeEntries joined, rest, last;
+    KEY_T separator, separator2;
+    SIZE_T i = 0;
     
-    //Root node first insertion
-    if(target.info.numkeys == 0 && target.info.nodetype == BTREE_ROOT_NODE){
-        //cout << "\n Key is " << KeyVal.key << "\n";
-        target.info.numkeys++;
-        rc = target.SetKey(0, KeyVal.key);
+    // The pairs are ptrs i and i+1 around key i: the child and its
+    // right neighbour first, then its left one
+    for (int side = 0; side < 2; side++) {
+        if (side ? num == 0 : num + 1 >= parent.ptrs.size()) {
+            continue;
+        }
+        SIZE_T pair = side ? num - 1 : num;
+        BTreeNode sibling;
+        NodeEntries siblingentries;
+        rc = sibling.Unserialize(buffercache, parent.ptrs[side ? pair : pair + 1], &superblock.info);
         if (rc) {  return rc; }
-        SIZE_T secondChildAddress;
+        rc = sibling.Unpack(siblingentries);
         if (rc) {  return rc; }
-        rc = target.GetPtr(1, secondChildAddress);
-        //cout << "\n secondChildAddress should be " << secondChildAddress << "\n";
+        
+        NodeEntries &left = side ? siblingentries : child;
+        NodeEntries &right = side ? child : siblingentries;
+        NodeEntries both = left;
+        // Interior nodes pull the separator down between their halves
+        if (!leaf) {
+            both.keys.push_back(parent.keys[pair]);
+            both.ptrs.insert(both.ptrs.end(), right.ptrs.begin(), right.ptrs.end());
+        } else {
+            both.vals.insert(both.vals.end(), right.vals.begin(), right.vals.end());
+            both.link = right.link;
+        }
+        both.keys.insert(both.keys.end(), right.keys.begin(), right.keys.end());
+        if (side == 0 || joined.keys.empty()) {
+            joined = both;
+            i = pair;
+        }
+        
+        KEY_T pairLow = pair > 0 ? parent.keys[pair - 1] : KEY_T();
+        KEY_T pairHigh = pair + 1 < parent.keys.size() ? parent.keys[pair + 1] : KEY_T();
+        const KEY_T *pairLowPtr = pair > 0 ? &pairLow : low;
+        const KEY_T *pairHighPtr = pair + 1 < parent.keys.size() ? &pairHigh : high;
+        
+        SIZE_T link = both.link;
+        DivideEntries(both, rest, separator);
+        if (leaf) {
+            both.link = parent.ptrs[pair + 1];
+            rest.link = link;
+        }
+        rc = first.Pack(both, pairLowPtr, &separator);
+        if (rc == ERROR_NOERROR) {
+            rc = second.Pack(rest, &separator, pairHighPtr);
+        }
+        if (rc == ERROR_NOSPACE) {
+            continue;
+        } else if (rc) {
+            return rc;
+        }
+        rc = first.Serialize(buffercache, parent.ptrs[pair]);
         if (rc) {  return rc; }
-        rc = target.Serialize(buffercache, node);
+        rc = second.Serialize(buffercache, parent.ptrs[pair + 1]);
         if (rc) {  return rc; }
-        return InsertNonFull(secondChildAddress, KeyVal);
-    } else if (target.info.numkeys == 0){ //If inserting into first child for first time.
-        target.info.numkeys += 1;
-        rc = target.SetKeyVal(0, KeyVal);
+        parent.keys[pair] = separator;
+        return ERROR_NOERROR;
+    }
+    if (joined.keys.empty()) {
+        // An only child, which can't happen below a well-formed parent
+        return ERROR_NOSPACE;
+    }
+    
+    // Both full: three nodes out of the pair's two, the new one last
+    KEY_T pairLow = i > 0 ? parent.keys[i - 1] : KEY_T();
+    KEY_T pairHigh = i + 1 < parent.keys.size() ? parent.keys[i + 1] : KEY_T();
+    const KEY_T *pairLowPtr = i > 0 ? &pairLow : low;
+    const KEY_T *pairHighPtr = i + 1 < parent.keys.size() ? &pairHigh : high;
+    SIZE_T newAddress;
+    
+    SIZE_T link = joined.link;
+    DivideEntries(joined, rest, separator, 1.0 / 3, BTREE_SPREAD_WINDOW_FRACTION);
+    DivideEntries(rest, last, separator2, 0.5, BTREE_SPREAD_WINDOW_FRACTION);
+    if (leaf) {
+        joined.link = parent.ptrs[i + 1];
+        last.link = link;
+    }
+    rc = first.Pack(joined, pairLowPtr, &separator);
+    if (rc == ERROR_NOERROR) {
+        rc = second.Pack(rest, &separator, &separator2);
+    }
+    if (rc == ERROR_NOERROR) {
+        rc = third.Pack(last, &separator2, pairHighPtr);
+    }
+    if (rc) {  return rc; }
+    
+    rc = AllocateNode(newAddress);
+    if (rc) {  return rc; }
+    if (leaf) {
+        rc = second.SetPtr(0, newAddress);
         if (rc) {  return rc; }
-        rc = target.Serialize(buffercache, node);
-        return rc;
     }
+    rc = first.Serialize(buffercache, parent.ptrs[i]);
+    if (rc) {  return rc; }
+    rc = second.Serialize(buffercache, parent.ptrs[i + 1]);
+    if (rc) {  return rc; }
+    rc = third.Serialize(buffercache, newAddress);
+    if (rc) {  return rc; }
+    parent.keys[i] = separator;
+    parent.keys.insert(parent.keys.begin() + i + 1, separator2);
+    parent.ptrs.insert(parent.ptrs.begin() + i + 2, newAddress);
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::InsertBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results)
+{
+    SIZE_T root = superblock.info.rootnode;
+    vector<KeyValuePair> internal;
+    vector<SIZE_T> order;
+    BTreeNode rootnode;
+    KEY_T scratch;
+    ERROR_T rc;
     
+    results.assign(pairs.size(), ERROR_NOERROR);
+    internal.reserve(pairs.size());
+    for (SIZE_T i = 0; i < pairs.size(); i++) {
+        internal.push_back(KeyValuePair(InternalKey(pairs[i].key, scratch), pairs[i].value));
+        if (RightSize(superblock.info, pairs[i].key, pairs[i].value)) {
+            order.push_back(i);
+        } else {
+            results[i] = ERROR_SIZE;
+        }
+    }
+    if (order.empty()) {
+        return ERROR_NOERROR;
+    }
+    // Equal keys stay in the order given, so the first of them wins
+    stable_sort(order.begin(), order.end(), BatchOrder(internal, superblock.info.flags));
     
+    // An empty tree gets its first leaves from an ordinary insert
+    rc = rootnode.Unserialize(buffercache, root, &superblock.info);
+    if (rc) {  return rc; }
+    SIZE_T first = 0;
+    if (rootnode.info.numkeys == 0) {
+        results[order[0]] = InsertOrUpdate(internal[order[0]], BTREE_OP_INSERT);
+        if (results[order[0]] != ERROR_NOERROR && results[order[0]] != ERROR_CONFLICT) {
+            return results[order[0]];
+        }
+        first = 1;
+    }
+    
+    vector<KeyValuePair> batch;
+    vector<SIZE_T> origin;
+    for (SIZE_T i = first; i < order.size(); i++) {
+        batch.push_back(internal[order[i]]);
+        origin.push_back(order[i]);
+    }
     
-    SIZE_T num = target.info.numkeys - 1;
-    KEY_T k;
-    // cout << "\n NUMBER OF KEYS IN NODE " << node << " IS " << num + 1 <<"\n";
-    rc = target.GetKey(num, k);
+    vector<KEY_T> separators;
+    vector<SIZE_T> addresses;
+    rc = InsertBatchInternal(root, batch, origin, 0, batch.size(), 0, 0,
+                             results, separators, addresses);
     if (rc) {  return rc; }
-    if (target.info.nodetype == BTREE_LEAF_NODE)
-    {
-        target.info.numkeys++;
-        while (num>0 && KeyVal.key < k)
-        {
-            // cout << "\n Inside While loop with num = " << num;
-            KeyValuePair p;
-            rc = target.GetKeyVal(num, p);
-            if (rc) {  return rc; }
-            rc = target.SetKeyVal(num+1, p);
-            if (rc) {  return rc; }
-            num--;
-            rc = target.GetKey(num, k);
+    for (SIZE_T i = 0; i < order.size(); i++) {
+        if (results[order[i]] == ERROR_NOERROR) {
+            rc = BloomAdd(internal[order[i]].key);
             if (rc) {  return rc; }
         }
-        
-        if(KeyVal.key == k){ //If the key already exists in the tree
-            num++;
-            while (num<target.info.numkeys-1) //Move everything back down NEEDS TO BE -1!!!!!
-            {
-                // cout << "\n Inside While loop with num = " << num;
-                KeyValuePair p;
-                rc = target.GetKeyVal(num+1, p);
+    }
+    
+    // The root split, maybe many ways: grow the tree until one node
+    // holds it all
+    SIZE_T top = root;
+    while (!addresses.empty()) {
+        SIZE_T newroot;
+        rc = AllocateNode(newroot);
+        if (rc) {  return rc; }
+        NodeEntries rootentries;
+        rootentries.nodetype = BTREE_ROOT_NODE;
+        rootentries.link = 0;
+        rootentries.keys = separators;
+        rootentries.ptrs.push_back(top);
+        rootentries.ptrs.insert(rootentries.ptrs.end(), addresses.begin(), addresses.end());
+        rc = WriteParts(newroot, rootentries, 0, 0, separators, addresses);
+        if (rc) {  return rc; }
+        top = newroot;
+    }
+    if (top != root) {
+        superblock.info.rootnode = top;
+        return superblock.Serialize(buffercache, superblock_index);
+    }
+    return ERROR_NOERROR;
+}
+
+//
+// Insert batch[first,last), sorted and in the nodes' key form, below
+// node, whose keys all lie in [low, high).  origin says where each came
+// from in results.  Children are done first and node is only rewritten
+// if something changed; if it had to split, separators and addresses
+// describe the new nodes after it, for the caller to link in.
+//
+ERROR_T BTreeIndex::InsertBatchInternal(const SIZE_T &node,
+                                        const vector<KeyValuePair> &batch,
+                                        const vector<SIZE_T> &origin,
+                                        const SIZE_T first,
+                                        const SIZE_T last,
+                                        const KEY_T *low,
+                                        const KEY_T *high,
+                                        vector<ERROR_T> &results,
+                                        vector<KEY_T> &separators,
+                                        vector<SIZE_T> &addresses)
+{
+    BTreeNode target;
+    NodeEntries entries, merged;
+    bool changed = false;
+    ERROR_T rc;
+    
+    separators.clear();
+    addresses.clear();
+    rc = target.Unserialize(buffercache, node, &superblock.info);
+    if (rc) {  return rc; }
+    rc = target.Unpack(entries);
+    if (rc) {  return rc; }
+    merged.nodetype = entries.nodetype;
+    merged.link = entries.link;
+    
+    if (entries.nodetype == BTREE_LEAF_NODE) {
+        // Merge the new keys in; one already there, or given earlier in
+        // the batch, is a conflict
+        SIZE_T i = 0;
+        for (SIZE_T j = first; j < last; j++) {
+            const KEY_T &key = batch[j].key;
+            while (i < entries.keys.size() &&
+                   BTreeNode::CompareKeys(entries.keys[i], key, superblock.info.flags) < 0) {
+                merged.keys.push_back(entries.keys[i]);
+                merged.vals.push_back(entries.vals[i]);
+                i++;
+            }
+            if ((i < entries.keys.size() &&
+                 BTreeNode::CompareKeys(entries.keys[i], key, superblock.info.flags) == 0) ||
+                (!merged.keys.empty() &&
+                 BTreeNode::CompareKeys(merged.keys.back(), key, superblock.info.flags) == 0)) {
+                results[origin[j]] = ERROR_CONFLICT;
+                continue;
+            }
+            VALUE_T stored;
+            const VALUE_T *value = &batch[j].value;
+            if (superblock.info.flags & BTREE_VALUELOG) {
+                rc = AppendToLog(batch[j].value, stored);
                 if (rc) {  return rc; }
-                rc = target.SetKeyVal(num, p);
+                value = &stored;
+            }
+            merged.keys.push_back(key);
+            merged.vals.push_back(*value);
+            results[origin[j]] = ERROR_NOERROR;
+            changed = true;
+        }
+        merged.keys.insert(merged.keys.end(), entries.keys.begin() + i, entries.keys.end());
+        merged.vals.insert(merged.vals.end(), entries.vals.begin() + i, entries.vals.end());
+    } else {
+        // Hand each child the keys that fall in its range, and take in
+        // any nodes it splits off, right after it
+        SIZE_T n = entries.keys.size();
+        SIZE_T j = first;
+        for (SIZE_T c = 0; c <= n; c++) {
+            SIZE_T end = j;
+            while (end < last &&
+                   (c == n || BTreeNode::CompareKeys(batch[end].key, entries.keys[c], superblock.info.flags) < 0)) {
+                end++;
+            }
+            merged.ptrs.push_back(entries.ptrs[c]);
+            if (end > j) {
+                vector<KEY_T> childSeparators;
+                vector<SIZE_T> childAddresses;
+                rc = InsertBatchInternal(entries.ptrs[c], batch, origin, j, end,
+                                         c > 0 ? &entries.keys[c - 1] : low,
+                                         c < n ? &entries.keys[c] : high,
+                                         results, childSeparators, childAddresses);
                 if (rc) {  return rc; }
-                num++;
+                merged.keys.insert(merged.keys.end(), childSeparators.begin(), childSeparators.end());
+                merged.ptrs.insert(merged.ptrs.end(), childAddresses.begin(), childAddresses.end());
+                changed = changed || !childAddresses.empty();
             }
-            target.info.numkeys--;
-            return ERROR_CONFLICT;
+            if (c < n) {
+                merged.keys.push_back(entries.keys[c]);
+            }
+            j = end;
         }
-        
-        if (num == 0 && KeyVal.key < k){
-            KeyValuePair p;
-            rc = target.GetKeyVal(0, p);
-            if (rc) {  return rc; }
-            rc = target.SetKeyVal(1, p);
-            if (rc) {  return rc; }
-        } else {
-            num++;
+    }
+    
+    if (!changed) {
+        return ERROR_NOERROR;
+    }
+    return WriteParts(node, merged, low, high, separators, addresses);
+}
+
+//
+// Pack entries into one node, or if they don't fit, into halves,
+// quarters and so on until each part fits against its fences.  The
+// parts go in order into parts, with the separators between them.
+//
+ERROR_T BTreeIndex::PackParts(NodeEntries &entries,
+                              const KEY_T *low,
+                              const KEY_T *high,
+                              vector<BTreeNode> &parts,
+                              vector<KEY_T> &separators) const
+{
+    BTreeNode part(entries.nodetype,
+                   superblock.info.keysize,
+                   superblock.info.valuesize,
+                   buffercache->GetBlockSize(),
+                   superblock.info.flags);
+    ERROR_T rc = part.Pack(entries, low, high);
+    if (rc == ERROR_NOERROR) {
+        parts.push_back(part);
+        return ERROR_NOERROR;
+    } else if (rc != ERROR_NOSPACE) {
+        return rc;
+    }
+    
+    NodeEntries right;
+    KEY_T separator;
+    DivideEntries(entries, right, separator);
+    rc = PackParts(entries, low, &separator, parts, separators);
+    if (rc) {  return rc; }
+    separators.push_back(separator);
+    return PackParts(right, &separator, high, parts, separators);
+}
+
+//
+// Write entries back to node, splitting it as many ways as it takes.
+// separators and addresses get the nodes after node, for the parent.
+//
+ERROR_T BTreeIndex::WriteParts(const SIZE_T &node,
+                               NodeEntries &entries,
+                               const KEY_T *low,
+                               const KEY_T *high,
+                               vector<KEY_T> &separators,
+                               vector<SIZE_T> &addresses)
+{
+    vector<BTreeNode> parts;
+    SIZE_T link = entries.link;
+    ERROR_T rc;
+    
+    separators.clear();
+    addresses.clear();
+    if (entries.nodetype == BTREE_ROOT_NODE) {
+        BTreeNode root(BTREE_ROOT_NODE,
+                       superblock.info.keysize,
+                       superblock.info.valuesize,
+                       buffercache->GetBlockSize(),
+                       superblock.info.flags);
+        rc = root.Pack(entries, low, high);
+        if (rc == ERROR_NOERROR) {
+            return root.Serialize(buffercache, node);
+        } else if (rc != ERROR_NOSPACE) {
+            return rc;
         }
-        
-        // cout <<"\n outside while loop";
-        rc = target.SetKeyVal(num, KeyVal);
-        if (rc) {  return rc; }
-        rc=target.Serialize(buffercache, node);
+        // A root that splits becomes an ordinary interior node
+        entries.nodetype = BTREE_INTERIOR_NODE;
+    }
+    rc = PackParts(entries, low, high, parts, separators);
+    if (rc) {  return rc; }
+    
+    addresses.resize(parts.size() - 1);
+    for (SIZE_T i = 0; i < addresses.size(); i++) {
+        rc = AllocateNode(addresses[i]);
         if (rc) {  return rc; }
     }
-    else
-    {
-        // cout << "\nInside insert non full with node type " << target.info.nodetype << " and num " << num << "\n";
-        while (num > 0 && KeyVal.key < k)
-        {
-            // cout << "\nInside loop with num " << num << "\n";
-            num--;
-            rc = target.GetKey(num, k);
+    for (SIZE_T i = 0; i < parts.size(); i++) {
+        // The leaves chain through the new nodes to where node led
+        if (parts[i].info.nodetype == BTREE_LEAF_NODE) {
+            rc = parts[i].SetPtr(0, i < addresses.size() ? addresses[i] : link);
             if (rc) {  return rc; }
         }
-        
-        if(num == 0){ //To differentiate between getting 0th child and 1st child
-            rc = target.GetKey(0, k);
-            if (rc) {  return rc; }
+        rc = parts[i].Serialize(buffercache, i == 0 ? node : addresses[i - 1]);
+        if (rc) {  return rc; }
+    }
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+    KEY_T scratch;
+    
+    if (!RightSize(superblock.info, key, value)) {
+        return ERROR_SIZE;
+    }
+    const KEY_T &internal = InternalKey(key, scratch);
+    if (!BloomMayContain(internal)) {
+        return ERROR_NONEXISTENT;
+    } else if (superblock.info.flags & BTREE_VARLEN) {
+        // The value may change size and no longer fit where it is
+        VALUE_T replaced;
+        ERROR_T rc = InsertOrUpdate(KeyValuePair(internal, value), BTREE_OP_UPDATE, &replaced);
+        if (rc == ERROR_NOERROR && replaced.length) {
+            // Only now does nothing point to the old copy
+            rc = ReleaseFromLog(replaced);
         }
-        //RECENT CHANGE
-        if(k < KeyVal.key){
-            num++;
-        } else if(KeyVal.key == k){
-            return ERROR_CONFLICT;
+        return rc;
+    } else{
+        return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, internal, (VALUE_T&)value);
+    }
+}
+
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+    KEY_T scratch;
+    ERROR_T rc;
+    bool underflow;
+    
+    if (!RightKeySize(superblock.info, key)) {
+        return ERROR_SIZE;
+    }
+    // Deleted keys stay in the filter; they just cost a descent
+    const KEY_T &internal = InternalKey(key, scratch);
+    if (!BloomMayContain(internal)) {
+        return ERROR_NONEXISTENT;
+    }
+    
+    BTreeNode rootnode;
+    rc = rootnode.Unserialize(buffercache, superblock.info.rootnode, &superblock.info);
+    if (rc) {  return rc; }
+    if (rootnode.info.numkeys == 0) {
+        return ERROR_NONEXISTENT;
+    }
+    
+    rc = DeleteInternal(superblock.info.rootnode, internal, 0, 0, underflow);
+    if (rc) {  return rc; }
+    return CollapseRoot();
+}
+
+//
+// Delete key below node, whose keys all lie in [low, high).  Children
+// left underfull are fixed on the way back up; underflow says whether
+// node itself now is, for its parent to deal with.
+//
+ERROR_T BTreeIndex::DeleteInternal(const SIZE_T &node,
+                                   const KEY_T &key,
+                                   const KEY_T *low,
+                                   const KEY_T *high,
+                                   bool &underflow)
+{
+    BTreeNode target;
+    SIZE_T num;
+    ERROR_T rc = target.Unserialize(buffercache, node, &superblock.info);
+    if (rc) {  return rc; }
+    
+    underflow = false;
+    
+    if (target.info.nodetype == BTREE_LEAF_NODE) {
+        num = target.LowerBound(key, &ops);
+        if (num >= target.info.numkeys || target.CompareKey(num, key) != 0) {
+            return ERROR_NONEXISTENT;
         }
-        
-        
-        BTreeNode child;
-        SIZE_T childAddress;
-        
-        rc = target.GetPtr(num, childAddress);
+        VALUE_T stored;
+        if (superblock.info.flags & BTREE_VALUELOG) {
+            rc = target.GetVal(num, stored);
+            if (rc) {  return rc; }
+        }
+        rc = target.RemoveKeyVal(num);
         if (rc) {  return rc; }
-        rc= child.Unserialize(buffercache, childAddress);
+        rc = target.Serialize(buffercache, node);
         if (rc) {  return rc; }
-        if (IsFull(childAddress))
-        {
-            rc = SplitChild(node, num);
-            if (rc) {  return rc; }
-            ERROR_T rc = target.Unserialize(buffercache, node);
+        if (superblock.info.flags & BTREE_VALUELOG) {
+            rc = ReleaseFromLog(stored);
             if (rc) {  return rc; }
-            
-            rc = target.GetKey(num, k);
-            
-            if (k < KeyVal.key || k == KeyVal.key)
-            {
-                num++;
-                rc = target.GetPtr(num, childAddress);
-                if (rc) {  return rc; }
-                rc= child.Unserialize(buffercache, childAddress);
-                if (rc) {  return rc; }
-            }
         }
-        // cout << "\nMade it to next InsertNonFull call with child address " << childAddress << "\n";
-        rc = InsertNonFull(childAddress, KeyVal);
+        underflow = target.IsUnderfull();
+        return ERROR_NOERROR;
+    }
+    
+    num = target.UpperBound(key, &ops);
+    
+    KEY_T childLow, childHigh;
+    if (num > 0) {
+        rc = target.GetKey(num - 1, childLow);
         if (rc) {  return rc; }
-        // if(num > 0){
-        //   rc = target.SetKey(num-1, k);
-        //   if (rc) {  return rc; }
-        // }
-        
-        
-        
     }
+    if (num < target.info.numkeys) {
+        rc = target.GetKey(num, childHigh);
+        if (rc) {  return rc; }
+    }
+    SIZE_T childAddress;
+    rc = target.GetPtr(num, childAddress, &ops);
+    if (rc) {  return rc; }
+    
+    bool childUnderflow;
+    rc = DeleteInternal(childAddress, key,
+                        num > 0 ? &childLow : low,
+                        num < target.info.numkeys ? &childHigh : high,
+                        childUnderflow);
+    if (rc || !childUnderflow) {  return rc; }
+    
+    // With a single child there's no sibling to take from; if this is
+    // the root, Delete collapses it
+    if (target.info.numkeys == 0) {
+        return ERROR_NOERROR;
+    }
+    rc = RebalanceChild(node, target, num, low, high);
+    if (rc) {  return rc; }
+    underflow = target.IsUnderfull();
     return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+//
+// Child num of node (held in target) is underfull.  Merge it with a
+// neighbour if the two fit in one node, freeing the right one;
+// otherwise share their entries evenly, which changes the separator
+// between them.
+//
+ERROR_T BTreeIndex::RebalanceChild(const SIZE_T &node,
+                                   BTreeNode &target,
+                                   const SIZE_T num,
+                                   const KEY_T *low,
+                                   const KEY_T *high)
 {
-    if(key.length != superblock.info.keysize || value.length != superblock.info.valuesize){
-        return ERROR_SIZE;
-    } else{
-        return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, (VALUE_T&)value);
+    ERROR_T rc;
+    // The pair is ptrs i and i+1 around key i: the child and its right
+    // neighbour, or its left one if it is the last
+    SIZE_T i = num < target.info.numkeys ? num : num - 1;
+    SIZE_T leftAddress, rightAddress;
+    KEY_T separator, leftLow, rightHigh;
+    
+    rc = target.GetPtr(i, leftAddress);
+    if (rc) {  return rc; }
+    rc = target.GetPtr(i + 1, rightAddress);
+    if (rc) {  return rc; }
+    rc = target.GetKey(i, separator);
+    if (rc) {  return rc; }
+    if (i > 0) {
+        rc = target.GetKey(i - 1, leftLow);
+        if (rc) {  return rc; }
+    }
+    if (i + 1 < target.info.numkeys) {
+        rc = target.GetKey(i + 1, rightHigh);
+        if (rc) {  return rc; }
+    }
+    const KEY_T *pairLow = i > 0 ? &leftLow : low;
+    const KEY_T *pairHigh = i + 1 < target.info.numkeys ? &rightHigh : high;
+    
+    BTreeNode left, right;
+    NodeEntries entries, rightentries;
+    rc = left.Unserialize(buffercache, leftAddress, &superblock.info);
+    if (rc) {  return rc; }
+    rc = right.Unserialize(buffercache, rightAddress, &superblock.info);
+    if (rc) {  return rc; }
+    rc = left.Unpack(entries);
+    if (rc) {  return rc; }
+    rc = right.Unpack(rightentries);
+    if (rc) {  return rc; }
+    
+    // Interior nodes pull the separator down between their halves
+    if (entries.nodetype != BTREE_LEAF_NODE) {
+        entries.keys.push_back(separator);
+        entries.ptrs.insert(entries.ptrs.end(), rightentries.ptrs.begin(), rightentries.ptrs.end());
+    } else {
+        entries.vals.insert(entries.vals.end(), rightentries.vals.begin(), rightentries.vals.end());
+        entries.link = rightentries.link;
+    }
+    entries.keys.insert(entries.keys.end(), rightentries.keys.begin(), rightentries.keys.end());
+    
+    rc = left.Pack(entries, pairLow, pairHigh);
+    if (rc == ERROR_NOERROR) {
+        rc = left.Serialize(buffercache, leftAddress);
+        if (rc) {  return rc; }
+        rc = target.RemoveKeyPtr(i);
+        if (rc) {  return rc; }
+        rc = target.Serialize(buffercache, node);
+        if (rc) {  return rc; }
+        return DeallocateNode(rightAddress);
+    } else if (rc != ERROR_NOSPACE) {
+        return rc;
     }
+    
+    // Both nodes stay, so the left one links to the right one again
+    SIZE_T rightLink = entries.link;
+    DivideEntries(entries, rightentries, separator);
+    if (entries.nodetype == BTREE_LEAF_NODE) {
+        rightentries.link = rightLink;
+        entries.link = rightAddress;
+    }
+    
+    // Against their new fences the halves may share less of a prefix
+    // and not fit after all, and the new separator may be longer than
+    // the old one; either way nothing is written and the child is left
+    // underfull
+    rc = left.Pack(entries, pairLow, &separator);
+    if (rc == ERROR_NOERROR) {
+        rc = right.Pack(rightentries, &separator, pairHigh);
+    }
+    if (rc == ERROR_NOSPACE) {
+        return ERROR_NOERROR;
+    } else if (rc) {
+        return rc;
+    }
+    NodeEntries parententries;
+    rc = target.Unpack(parententries);
+    if (rc) {  return rc; }
+    parententries.keys[i] = separator;
+    rc = target.Pack(parententries, low, high);
+    if (rc == ERROR_NOSPACE) {
+        return target.Unserialize(buffercache, node, &superblock.info);
+    } else if (rc) {
+        return rc;
+    }
+    
+    rc = left.Serialize(buffercache, leftAddress);
+    if (rc) {  return rc; }
+    rc = right.Serialize(buffercache, rightAddress);
+    if (rc) {  return rc; }
+    return target.Serialize(buffercache, node);
 }
 
+//
+// A root left with no keys has one child.  An interior child takes
+// its place; a leaf can't be the root, so an empty one is freed
+// (leaving the empty tree) and any other is split back in two.
+//
+ERROR_T BTreeIndex::CollapseRoot()
+{
+    SIZE_T root = superblock.info.rootnode;
+    SIZE_T child;
+    BTreeNode rootnode, childnode;
+    ERROR_T rc;
+    
+    rc = rootnode.Unserialize(buffercache, root, &superblock.info);
+    if (rc) {  return rc; }
+    if (rootnode.info.numkeys > 0) {
+        return ERROR_NOERROR;
+    }
+    rc = rootnode.GetPtr(0, child);
+    if (rc) {  return rc; }
+    rc = childnode.Unserialize(buffercache, child, &superblock.info);
+    if (rc) {  return rc; }
+    
+    if (childnode.info.nodetype != BTREE_LEAF_NODE) {
+        childnode.info.nodetype = BTREE_ROOT_NODE;
+        rc = childnode.Serialize(buffercache, child);
+        if (rc) {  return rc; }
+        superblock.info.rootnode = child;
+        rc = superblock.Serialize(buffercache, superblock_index);
+        if (rc) {  return rc; }
+        return DeallocateNode(root);
+    }
+    if (childnode.info.numkeys == 0) {
+        return DeallocateNode(child);
+    }
+    
+    NodeEntries entries, right;
+    KEY_T separator;
+    rc = childnode.Unpack(entries);
+    if (rc) {  return rc; }
+    if (entries.keys.size() == 1) {
+        // Nothing to cut between: the key goes right, the left is empty
+        right = entries;
+        entries.keys.clear();
+        entries.vals.clear();
+        separator = right.keys[0];
+    } else {
+        DivideEntries(entries, right, separator);
+    }
+    
+    SIZE_T rightAddress;
+    rc = AllocateNode(rightAddress);
+    if (rc) {  return rc; }
+    right.link = entries.link;
+    entries.link = rightAddress;
+    BTreeNode rightnode(BTREE_LEAF_NODE,
+                        superblock.info.keysize,
+                        superblock.info.valuesize,
+                        buffercache->GetBlockSize(),
+                        superblock.info.flags);
+    rc = rightnode.Pack(right, &separator, 0);
+    if (rc) {  return rc; }
+    rc = childnode.Pack(entries, 0, &separator);
+    if (rc) {  return rc; }
+    
+    NodeEntries rootentries;
+    rootentries.nodetype = BTREE_ROOT_NODE;
+    rootentries.keys.push_back(separator);
+    rootentries.ptrs.push_back(child);
+    rootentries.ptrs.push_back(rightAddress);
+    rc = rootnode.Pack(rootentries, 0, 0);
+    if (rc) {  return rc; }
+    
+    rc = childnode.Serialize(buffercache, child);
+    if (rc) {  return rc; }
+    rc = rightnode.Serialize(buffercache, rightAddress);
+    if (rc) {  return rc; }
+    return rootnode.Serialize(buffercache, root);
+}
 
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+
+//
+// Cut entries of the given sizes into runs for nodes that hold cap,
+// filling each to about target.  With firstFree the first entry of a
+// run costs nothing: it is an interior node's first child, whose
+// separator goes up a level rather than into the node.  A last run
+// under half the target is evened out with the one before.  starts
+// gets where each run begins.
+//
+static void CutRuns(const vector<SIZE_T> &sizes,
+                    const SIZE_T target,
+                    const SIZE_T cap,
+                    const bool firstFree,
+                    vector<SIZE_T> &starts)
+{
+    SIZE_T n = sizes.size();
+    SIZE_T used = 0;
+    vector<SIZE_T> before(n + 1, 0); // sizes of entries [0,i)
+    
+    starts.clear();
+    for (SIZE_T i = 0; i < n; i++) {
+        before[i + 1] = before[i] + sizes[i];
+        if (starts.empty() || used + sizes[i] > target) {
+            starts.push_back(i);
+            used = firstFree ? 0 : sizes[i];
+        } else {
+            used += sizes[i];
+        }
+    }
+    if (starts.size() < 2) {
+        return;
+    }
+    
+    SIZE_T p = starts[starts.size() - 2];
+    SIZE_T best = starts.back();
+    SIZE_T lastcost = before[n] - before[best] - (firstFree ? sizes[best] : 0);
+    if (2 * lastcost >= target) {
+        return;
+    }
+    SIZE_T bestmax = cap + 1;
+    for (SIZE_T q = p + 1; q < n; q++) {
+        SIZE_T left = before[q] - before[p] - (firstFree ? sizes[p] : 0);
+        SIZE_T right = before[n] - before[q] - (firstFree ? sizes[q] : 0);
+        SIZE_T most = left > right ? left : right;
+        if (most < bestmax) {
+            best = q;
+            bestmax = most;
+        }
+    }
+    starts.back() = best;
+}
+
+//
+// A run's target size: fill of cap, but at least the largest entry
+//
+static SIZE_T RunTarget(const vector<SIZE_T> &sizes, const SIZE_T cap, const double fill)
+{
+    SIZE_T target = (SIZE_T) (fill * cap);
+    for (SIZE_T i = 0; i < sizes.size(); i++) {
+        if (sizes[i] > target) {
+            target = sizes[i];
+        }
+    }
+    return target;
+}
+
+ERROR_T BTreeIndex::BulkLoad(const vector<KeyValuePair> &pairs, const double fill)
 {
-    // This is optional extra credit
-    //
-    //
-    return ERROR_UNIMPL;
+    SIZE_T n = pairs.size();
+    bool varlen = superblock.info.flags & BTREE_VARLEN;
+    SIZE_T blocksize = buffercache->GetBlockSize();
+    BTreeNode rootnode;
+    KEY_T scratch;
+    ERROR_T rc;
+    
+    if (!(fill > 0 && fill <= 1)) {
+        return ERROR_BADCONFIG;
+    }
+    rc = rootnode.Unserialize(buffercache, superblock.info.rootnode, &superblock.info);
+    if (rc) {  return rc; }
+    if (rootnode.info.numkeys > 0) {
+        return ERROR_CONFLICT;
+    }
+    
+    // Check all of it before writing anything
+    NodeEntries all;
+    all.nodetype = BTREE_LEAF_NODE;
+    all.keys.resize(n);
+    for (SIZE_T i = 0; i < n; i++) {
+        if (!RightSize(superblock.info, pairs[i].key, pairs[i].value)) {
+            return ERROR_SIZE;
+        }
+        all.keys[i] = InternalKey(pairs[i].key, scratch);
+        if (i > 0 && BTreeNode::CompareKeys(all.keys[i - 1], all.keys[i], superblock.info.flags) >= 0) {
+            return ERROR_CONFLICT;
+        }
+    }
+    if (n == 0) {
+        return ERROR_NOERROR;
+    }
+    
+    // Logged values are written first, so the log comes before the
+    // leaves on disk
+    all.vals.resize(n);
+    for (SIZE_T i = 0; i < n; i++) {
+        if (superblock.info.flags & BTREE_VALUELOG) {
+            rc = AppendToLog(pairs[i].value, all.vals[i]);
+            if (rc) {  return rc; }
+        } else {
+            all.vals[i] = pairs[i].value;
+        }
+        rc = BloomAdd(all.keys[i]);
+        if (rc) {  return rc; }
+    }
+    
+    // The leaves.  The root needs a key, so there are at least two,
+    // even if the first is empty.
+    BTreeNode leaf(BTREE_LEAF_NODE,
+                   superblock.info.keysize,
+                   superblock.info.valuesize,
+                   blocksize,
+                   superblock.info.flags);
+    SIZE_T cap = varlen ? BTreeNode::SlottedCapacity(blocksize) : leaf.info.GetNumSlotsAsLeaf();
+    vector<SIZE_T> sizes(n), starts;
+    for (SIZE_T i = 0; i < n; i++) {
+        sizes[i] = varlen ? BTreeNode::CellBytes(BTREE_LEAF_NODE, all.keys[i].length, all.vals[i].length) : 1;
+    }
+    CutRuns(sizes, RunTarget(sizes, cap, fill), cap, false, starts);
+    if (starts.size() < 2) {
+        starts.push_back(n / 2);
+    }
+    
+    SIZE_T count = starts.size();
+    vector<SIZE_T> addresses(count);
+    vector<KEY_T> separators(count); // what goes up ahead of each node but the first
+    for (SIZE_T j = 0; j < count; j++) {
+        rc = AllocateNode(addresses[j]);
+        if (rc) {  return rc; }
+        if (j > 0) {
+            SIZE_T a = starts[j];
+            separators[j] = a > 0 ? ShortestSeparator(all.keys[a - 1], all.keys[a]) : all.keys[a];
+        }
+    }
+    for (SIZE_T j = 0; j < count; j++) {
+        SIZE_T end = j + 1 < count ? starts[j + 1] : n;
+        NodeEntries entries;
+        entries.nodetype = BTREE_LEAF_NODE;
+        entries.link = j + 1 < count ? addresses[j + 1] : 0;
+        entries.keys.assign(all.keys.begin() + starts[j], all.keys.begin() + end);
+        entries.vals.assign(all.vals.begin() + starts[j], all.vals.begin() + end);
+        rc = leaf.Pack(entries,
+                       j > 0 ? &separators[j] : 0,
+                       j + 1 < count ? &separators[j + 1] : 0);
+        if (rc) {  return rc; }
+        rc = leaf.Serialize(buffercache, addresses[j]);
+        if (rc) {  return rc; }
+    }
+    
+    // Interior levels, until one node (the root) takes the lot
+    BTreeNode interior(BTREE_INTERIOR_NODE,
+                       superblock.info.keysize,
+                       superblock.info.valuesize,
+                       blocksize,
+                       superblock.info.flags);
+    cap = varlen ? BTreeNode::SlottedCapacity(blocksize) : interior.info.GetNumSlotsAsInterior();
+    vector<SIZE_T> children;
+    vector<KEY_T> childseps;
+    for (;;) {
+        children.swap(addresses);
+        childseps.swap(separators);
+        SIZE_T m = children.size();
+        SIZE_T total = 0;
+        sizes.assign(m, 0);
+        for (SIZE_T i = 1; i < m; i++) {
+            sizes[i] = varlen ? BTreeNode::CellBytes(BTREE_INTERIOR_NODE, childseps[i].length, 0) : 1;
+            total += sizes[i];
+        }
+        SIZE_T target = RunTarget(sizes, cap, fill);
+        if (total <= target) {
+            break;
+        }
+        CutRuns(sizes, target, cap, true, starts);
+        
+        count = starts.size();
+        addresses.assign(count, 0);
+        separators.assign(count, KEY_T());
+        for (SIZE_T j = 0; j < count; j++) {
+            rc = AllocateNode(addresses[j]);
+            if (rc) {  return rc; }
+            if (j > 0) {
+                separators[j] = childseps[starts[j]];
+            }
+        }
+        for (SIZE_T j = 0; j < count; j++) {
+            SIZE_T end = j + 1 < count ? starts[j + 1] : m;
+            NodeEntries entries;
+            entries.nodetype = BTREE_INTERIOR_NODE;
+            entries.link = 0;
+            entries.keys.assign(childseps.begin() + starts[j] + 1, childseps.begin() + end);
+            entries.ptrs.assign(children.begin() + starts[j], children.begin() + end);
+            rc = interior.Pack(entries,
+                               j > 0 ? &separators[j] : 0,
+                               j + 1 < count ? &separators[j + 1] : 0);
+            if (rc) {  return rc; }
+            rc = interior.Serialize(buffercache, addresses[j]);
+            if (rc) {  return rc; }
+        }
+    }
+    
+    NodeEntries rootentries;
+    rootentries.nodetype = BTREE_ROOT_NODE;
+    rootentries.link = 0;
+    rootentries.keys.assign(childseps.begin() + 1, childseps.end());
+    rootentries.ptrs = children;
+    rc = rootnode.Pack(rootentries, 0, 0);
+    if (rc) {  return rc; }
+    return rootnode.Serialize(buffercache, superblock.info.rootnode);
 }
 
 
@@ -762,7 +2176,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
     ERROR_T rc;
     SIZE_T offset;
     
-    rc= b.Unserialize(buffercache,node);
+    rc= b.Unserialize(buffercache,node,&superblock.info);
     
     if (rc!=ERROR_NOERROR) {
         return rc;
@@ -814,6 +2228,27 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 {
     ERROR_T rc;
+    if (display_type==BTREE_SORTED_KEYVAL) {
+        // Just the leaves, along their links
+        BTreeCursor cursor(*this);
+        KEY_T key;
+        VALUE_T value;
+        SIZE_T i;
+        rc=cursor.SeekFirst();
+        if (rc) { return rc; }
+        while ((rc=cursor.Next(key,value))==ERROR_NOERROR) {
+            o << "(";
+            for (i=0;i<key.length;i++) {
+                o << key.data[i];
+            }
+            o << ",";
+            for (i=0;i<value.length;i++) {
+                o << value.data[i];
+            }
+            o << ")\n";
+        }
+        return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+    }
     if (display_type==BTREE_DEPTH_DOT) {
         o << "digraph tree { \n";
     }
@@ -824,27 +2259,36 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
     return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::IsInOrder(const SIZE_T &nodeaddress, const KEY_T &minBound, const KEY_T &maxBound, const KEY_T &keyMin, const KEY_T &keyMax) const
+//
+// Check that node's keys are in order and within [minBound, maxBound)
+// (0 meaning unbounded), and the same for its subtrees.  Leaves are
+// met left to right, so each must be the one the previous leaf links
+// to (nextLeaf).
+//
+ERROR_T BTreeIndex::IsInOrder(const SIZE_T &nodeaddress,
+                              const KEY_T *minBound,
+                              const KEY_T *maxBound,
+                              SIZE_T &nextLeaf) const
 {
     ERROR_T rc;
     BTreeNode node;
-    rc = node.Unserialize(buffercache, nodeaddress);
+    rc = node.Unserialize(buffercache, nodeaddress, &superblock.info);
     if (rc) {  return rc; }
     KEY_T lesserKeyVal;
     KEY_T greaterKeyVal;
     
-    //Check the 1st key is equal to min bound, if there is one
-    if (keyMin < minBound && node.info.numkeys > 0) {
+    //Check the 1st key is not below the min bound, if there is one
+    if (minBound && node.info.numkeys > 0) {
         rc = node.GetKey(0, lesserKeyVal);
         if (rc) {  return rc; }
-        if (!(lesserKeyVal == minBound)) {  return ERROR_BADCONFIG;  }
+        if (BTreeNode::CompareKeys(lesserKeyVal, *minBound, superblock.info.flags) < 0) {  return ERROR_BADCONFIG;  }
     }
     
     //Check the last key is less than the max bound, if there is one
-    if (maxBound < keyMax && node.info.numkeys > 0) {
+    if (maxBound && node.info.numkeys > 0) {
         rc = node.GetKey((node.info.numkeys - 1), greaterKeyVal);
         if (rc) {  return rc; }
-        if (!(greaterKeyVal < maxBound)) {  return ERROR_BADCONFIG;  }
+        if (BTreeNode::CompareKeys(greaterKeyVal, *maxBound, superblock.info.flags) >= 0) {  return ERROR_BADCONFIG;  }
     }
     
     //Check that all keys are in order
@@ -853,7 +2297,7 @@ ERROR_T BTreeIndex::IsInOrder(const SIZE_T &nodeaddress, const KEY_T &minBound,
         if (rc) {  return rc; }
         rc = node.GetKey(i+1, greaterKeyVal);
         if (rc) {  return rc; }
-        if (!(lesserKeyVal < greaterKeyVal)) {  return ERROR_BADCONFIG; }
+        if (BTreeNode::CompareKeys(lesserKeyVal, greaterKeyVal, superblock.info.flags) >= 0) {  return ERROR_BADCONFIG; }
     }
     
     //Recurse on each child pointer if not leaf
@@ -864,23 +2308,26 @@ ERROR_T BTreeIndex::IsInOrder(const SIZE_T &nodeaddress, const KEY_T &minBound,
             rc = node.GetPtr(i, childAddress);
             if (rc) {  return rc; }
             // Get min bound
-            if (i == 0) {
-                lesserKeyVal = keyMin;
-            } else {
+            if (i > 0) {
                 rc = node.GetKey(i-1, lesserKeyVal);
                 if (rc) {  return rc; }
             }
             // Get max bound
-            if (i == node.info.numkeys) {
-                greaterKeyVal = keyMax;
-            } else {
+            if (i < node.info.numkeys) {
                 rc = node.GetKey(i, greaterKeyVal);
                 if (rc) {  return rc; }
             }
             // Recurse
-            rc = IsInOrder(childAddress, lesserKeyVal, greaterKeyVal, keyMin, keyMax);
+            rc = IsInOrder(childAddress,
+                           i > 0 ? &lesserKeyVal : minBound,
+                           i < node.info.numkeys ? &greaterKeyVal : maxBound,
+                           nextLeaf);
             if (rc) {  return rc; }
         }
+    } else {
+        if (nodeaddress != nextLeaf) {  return ERROR_INSANE;  }
+        rc = node.GetPtr(0, nextLeaf);
+        if (rc) {  return rc; }
     }
     
     // All good if we reached this point!
@@ -893,23 +2340,27 @@ ERROR_T BTreeIndex::SanityCheck() const
     SIZE_T root = superblock.info.rootnode;
     ERROR_T rc;
     BTreeNode rootnode;
-    rc = rootnode.Unserialize(buffercache, root);
+    rc = rootnode.Unserialize(buffercache, root, &superblock.info);
     if (rc || rootnode.info.numkeys < 1) {  return rc; }
     
-    // Calculate smallest possible node
-    KEY_T keyMin;
-    rc = rootnode.GetKey(0, keyMin);
-    memset(keyMin.data,0,superblock.info.keysize);
-    keyMin.length = superblock.info.keysize;
-    
-    // Calculate greatest possible node
-    KEY_T keyMax;
-    rc = rootnode.GetKey(0, keyMax);
-    memset(keyMax.data,-1,superblock.info.keysize);
-    keyMax.length = superblock.info.keysize;
+    // The leaf chain starts at the leftmost leaf
+    SIZE_T nextLeaf = root;
+    BTreeNode node(rootnode);
+    while (node.info.nodetype != BTREE_LEAF_NODE) {
+        if (node.info.nodetype != BTREE_ROOT_NODE && node.info.nodetype != BTREE_INTERIOR_NODE) {
+            return ERROR_INSANE;
+        }
+        rc = node.GetPtr(0, nextLeaf);
+        if (rc) {  return rc; }
+        rc = node.Unserialize(buffercache, nextLeaf, &superblock.info);
+        if (rc) {  return rc; }
+    }
     
     // Call recursive helper function
-    return IsInOrder(root, keyMin, keyMax, keyMin, keyMax);
+    rc = IsInOrder(root, 0, 0, nextLeaf);
+    if (rc) {  return rc; }
+    // and the last leaf ends the chain
+    return nextLeaf == 0 ? ERROR_NOERROR : ERROR_INSANE;
 }
 
 ostream & BTreeIndex::Print(ostream &os) const
@@ -921,3 +2372,120 @@ ostream & BTreeIndex::Print(ostream &os) const
 
 
 
+
+
+BTreeCursor::BTreeCursor(const BTreeIndex &idx) :
+    index(&idx), offset(0), atEnd(true), limited(false)
+{
+}
+
+//
+// Down to the leaf that would hold key (the leftmost leaf if key is 0),
+// at the first entry >= key
+//
+ERROR_T BTreeCursor::Descend(const KEY_T *key)
+{
+    const NodeMetadata *tree = &index->superblock.info;
+    SIZE_T node = tree->rootnode;
+    BTreeNode b;
+    ERROR_T rc;
+    
+    atEnd = true;
+    offset = 0;
+    
+    rc = b.View(index->buffercache, node, tree);
+    if (rc) {  return rc; }
+    if (b.info.numkeys == 0) {
+        // Empty tree
+        return ERROR_NOERROR;
+    }
+    while (b.info.nodetype != BTREE_LEAF_NODE) {
+        if (b.info.nodetype != BTREE_ROOT_NODE && b.info.nodetype != BTREE_INTERIOR_NODE) {
+            return ERROR_INSANE;
+        }
+        rc = b.GetPtr(key ? b.UpperBound(*key, &index->ops) : 0, node, &index->ops);
+        if (rc) {  return rc; }
+        rc = b.View(index->buffercache, node, tree);
+        if (rc) {  return rc; }
+    }
+    // Keep a copy, since views go away as the cache evicts
+    rc = leaf.Unserialize(index->buffercache, node, tree);
+    if (rc) {  return rc; }
+    offset = key ? leaf.LowerBound(*key, &index->ops) : 0;
+    atEnd = false;
+    return ERROR_NOERROR;
+}
+
+ERROR_T BTreeCursor::Seek(const KEY_T &key)
+{
+    KEY_T scratch;
+    
+    if (!RightKeySize(index->superblock.info, key)) {
+        return ERROR_SIZE;
+    }
+    return Descend(&index->InternalKey(key, scratch));
+}
+
+ERROR_T BTreeCursor::SeekFirst()
+{
+    return Descend(0);
+}
+
+ERROR_T BTreeCursor::SetLimit(const KEY_T &end)
+{
+    KEY_T scratch;
+    
+    if (!RightKeySize(index->superblock.info, end)) {
+        return ERROR_SIZE;
+    }
+    limit = index->InternalKey(end, scratch);
+    limited = true;
+    return ERROR_NOERROR;
+}
+
+void BTreeCursor::ClearLimit()
+{
+    limited = false;
+}
+
+ERROR_T BTreeCursor::Next(KEY_T &key, VALUE_T &value)
+{
+    const NodeMetadata *tree = &index->superblock.info;
+    SIZE_T next;
+    ERROR_T rc;
+    
+    // Past the end of this leaf (maybe an empty one): on to the next
+    while (!atEnd && offset >= leaf.info.numkeys) {
+        rc = leaf.GetPtr(0, next);
+        if (rc) {  return rc; }
+        if (next == 0) {
+            atEnd = true;
+        } else {
+            rc = leaf.Unserialize(index->buffercache, next, tree);
+            if (rc) {  return rc; }
+            offset = 0;
+        }
+    }
+    if (atEnd) {
+        return ERROR_NONEXISTENT;
+    }
+    
+    rc = leaf.GetKey(offset, key);
+    if (rc) {  return rc; }
+    if (limited && BTreeNode::CompareKeys(key, limit, tree->flags) >= 0) {
+        atEnd = true;
+        return ERROR_NONEXISTENT;
+    }
+    rc = leaf.GetVal(offset, value);
+    if (rc) {  return rc; }
+    if (tree->flags & BTREE_VALUELOG) {
+        VALUE_T stored(value);
+        rc = index->ReadFromLog(stored, value);
+        if (rc) {  return rc; }
+    }
+    if (tree->flags & BTREE_INTKEYS) {
+        BTreeNode::SwapIntKey(key);
+    }
+    offset++;
+    return ERROR_NOERROR;
+}
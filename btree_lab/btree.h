@@ -38,15 +38,36 @@ struct KeyValuePair {
     
 };
 
+// Splits look for the shortest separator within n/this entries of the
+// middle of the node
+#define BTREE_SPLIT_WINDOW_FRACTION 8
+
+// The 2-to-3 split of a full pair uses a narrower window so each third
+// stays close to n/3 and the nodes stay about 2/3 full
+#define BTREE_SPREAD_WINDOW_FRACTION 32
+
+// How full BulkLoad makes nodes by default, leaving some room for
+// later inserts
+#define BTREE_BULK_FILL 0.9
+
+// When an insert at the very right end of the tree splits a node, the
+// left part keeps this much of it rather than half, since more keys
+// are likely to follow on the right and none to come back to the left
+#define BTREE_APPEND_FILL 0.9
+
 enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP};
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+class BTreeCursor;
+
 class BTreeIndex {
+    friend class BTreeCursor;
 private:
     BufferCache *buffercache;
     SIZE_T       superblock_index;
     BTreeNode    superblock;
+    NodeOps      ops;  // search kernels for our keysize, set up at Attach
     
 protected:
     
@@ -54,24 +75,115 @@ protected:
     
     ERROR_T      DeallocateNode(const SIZE_T &node);
     
+    SIZE_T       BloomBits(const KEY_T &key, SIZE_T bits[BTREE_BLOOM_PROBES]) const;
+    bool         BloomMayContain(const KEY_T &key) const;
+    ERROR_T      BloomAdd(const KEY_T &key);
+    
     ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
                                         const BTreeOp op,
                                         const KEY_T &key,
                                         VALUE_T &val);
     
     
+    ERROR_T      PrintNode(ostream &os,
+                           SIZE_T nodenum,
+                           BTreeNode &b,
+                           BTreeDisplayType dt) const;
+    
+    ERROR_T      AppendToLog(const VALUE_T &value, VALUE_T &stored);
+    ERROR_T      ReadFromLog(const VALUE_T &stored, VALUE_T &value) const;
+    ERROR_T      WriteToLog(const VALUE_T &value, VALUE_T &stored);
+    ERROR_T      ReleaseFromLog(const VALUE_T &stored);
+    
     ERROR_T      DisplayInternal(const SIZE_T &node,
                                  ostream &o,
                                  const BTreeDisplayType display_type=BTREE_DEPTH) const;
-    ERROR_T     SplitChild(const SIZE_T &parentNode, const SIZE_T i);
+    ERROR_T     InsertOrUpdate(const KeyValuePair &KeyVal,
+                               const BTreeOp op,
+                               VALUE_T *replaced=0);
+    
+    ERROR_T     InsertInternal(const SIZE_T &node,
+                               const KeyValuePair &KeyVal,
+                               const KEY_T *low,
+                               const KEY_T *high,
+                               bool &split,
+                               KEY_T &separator,
+                               SIZE_T &rightAddress,
+                               const BTreeOp op=BTREE_OP_INSERT,
+                               NodeEntries *overflow=0,
+                               VALUE_T *replaced=0);
+    
+    const KEY_T &InternalKey(const KEY_T &key, KEY_T &scratch) const;
     
-    ERROR_T     InsertNonFull(const SIZE_T &node, const KeyValuePair &KeyVal);
+    KEY_T       ShortestSeparator(const KEY_T &left, const KEY_T &right) const;
     
-    SIZE_T      NumSlots(const SIZE_T &node);
+    SIZE_T      ChooseSplit(const NodeEntries &entries,
+                            const double share=0.5,
+                            const SIZE_T windowfraction=BTREE_SPLIT_WINDOW_FRACTION) const;
     
-    bool        IsFull(const SIZE_T &node);
+    void        DivideEntries(NodeEntries &entries,
+                              NodeEntries &right,
+                              KEY_T &separator,
+                              const double share=0.5,
+                              const SIZE_T windowfraction=BTREE_SPLIT_WINDOW_FRACTION) const;
     
-    ERROR_T   IsInOrder(const SIZE_T &nodeaddress, const KEY_T &minBound, const KEY_T &maxBound, const KEY_T &keyMin, const KEY_T &keyMax) const;
+    ERROR_T     SplitNode(const SIZE_T &node,
+                          BTreeNode &target,
+                          NodeEntries &entries,
+                          const KEY_T *low,
+                          const KEY_T *high,
+                          KEY_T &separator,
+                          SIZE_T &rightAddress,
+                          const bool append=false);
+    
+    ERROR_T     SpreadChild(NodeEntries &parent,
+                            const SIZE_T num,
+                            NodeEntries &child,
+                            const KEY_T *low,
+                            const KEY_T *high);
+    
+    ERROR_T     PackParts(NodeEntries &entries,
+                          const KEY_T *low,
+                          const KEY_T *high,
+                          vector<BTreeNode> &parts,
+                          vector<KEY_T> &separators) const;
+    
+    ERROR_T     WriteParts(const SIZE_T &node,
+                           NodeEntries &entries,
+                           const KEY_T *low,
+                           const KEY_T *high,
+                           vector<KEY_T> &separators,
+                           vector<SIZE_T> &addresses);
+    
+    ERROR_T     InsertBatchInternal(const SIZE_T &node,
+                                    const vector<KeyValuePair> &batch,
+                                    const vector<SIZE_T> &origin,
+                                    const SIZE_T first,
+                                    const SIZE_T last,
+                                    const KEY_T *low,
+                                    const KEY_T *high,
+                                    vector<ERROR_T> &results,
+                                    vector<KEY_T> &separators,
+                                    vector<SIZE_T> &addresses);
+    
+    ERROR_T     DeleteInternal(const SIZE_T &node,
+                               const KEY_T &key,
+                               const KEY_T *low,
+                               const KEY_T *high,
+                               bool &underflow);
+    
+    ERROR_T     RebalanceChild(const SIZE_T &node,
+                               BTreeNode &target,
+                               const SIZE_T num,
+                               const KEY_T *low,
+                               const KEY_T *high);
+    
+    ERROR_T     CollapseRoot();
+    
+    ERROR_T   IsInOrder(const SIZE_T &nodeaddress,
+                        const KEY_T *minBound,
+                        const KEY_T *maxBound,
+                        SIZE_T &nextLeaf) const;
 public:
     //
     // keysize and valueszie should be stored in the
@@ -83,10 +195,17 @@ public:
     // otherwise, the expectation is that keysize and valuesize
     // will be zero and will be read when Attach(initialblock,false) is
     // invoked
+    //
+    // With BTREE_VARLEN in flags, keysize and valuesize are maximums
+    // and keys and values may have any length up to them.  With
+    // BTREE_INTKEYS, keys are 8 byte big-endian integers, searched by
+    // interpolation if BTREE_INTERPOLATE is also given.  With
+    // BTREE_VALUELOG, values are kept out of the leaves in a log.
     BTreeIndex(SIZE_T keysize,
                SIZE_T valuesize,
                BufferCache *cache,
-               bool unique=true);   // true if a  key maps to a single value
+               bool unique=true,    // true if a  key maps to a single value
+               SIZE_T flags=0);
     
     
     BTreeIndex();
@@ -116,6 +235,15 @@ public:
     // return ERROR_CONFLICT if the key already exists and it's a unique index
     ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
     
+    // Insert all of pairs in one walk down the tree, in key order: each
+    // leaf takes all of its new keys at once, splitting as many ways as
+    // it needs to, and each node touched is written once.  results gets
+    // what Insert would have returned for each pair (ERROR_CONFLICT for
+    // a key given twice, after the first).
+    // return zero on success
+    // return ERROR_NOSPACE if you run out of disk space
+    ERROR_T InsertBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results);
+    
     // return zero on success
     // return ERROR_NONEXISTENT  if the key doesn't exist
     // return ERROR_SIZE if the key or value are the wrong size for this index
@@ -130,6 +258,27 @@ public:
     // return ERROR_NONEXISTENT  if the key doesn't exist
     ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
     
+    // Look up all of keys together.  They are sorted and go down the
+    // tree a level at a time, so each node on their paths is read
+    // once, in block number order.  values and results get, for each
+    // key, what Lookup would have given.
+    // return zero on success
+    ERROR_T LookupBatch(const vector<KEY_T> &keys,
+                        vector<VALUE_T> &values,
+                        vector<ERROR_T> &results);
+    
+    // Build an empty index from pairs sorted by key, bottom up: leaves
+    // filled to fill (a fraction of a node), then each interior level
+    // over the one below.  Blocks are allocated in the order they are
+    // written, so a freshly initialized index is laid out sequentially.
+    // return zero on success
+    // return ERROR_NOSPACE if you run out of disk space
+    // return ERROR_SIZE if a key or value is the wrong size for this index
+    // return ERROR_CONFLICT if the index isn't empty, or the keys aren't
+    // strictly increasing
+    // return ERROR_BADCONFIG if fill isn't in (0,1]
+    ERROR_T BulkLoad(const vector<KeyValuePair> &pairs, const double fill=BTREE_BULK_FILL);
+    
     // Here you should figure out if your index makes sense
     // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
     // a valid use ratio?
@@ -154,4 +303,44 @@ public:
 
 inline ostream & operator<<(ostream &os, const BTreeIndex &b) { return b.Print(os);}
 
+
+//
+// Walks an index's key/value pairs in key order, starting where Seek
+// puts it and stopping before the limit, if one is set.  It descends
+// the tree once and then follows the links between leaves.  Any change
+// to the index invalidates it.
+//
+class BTreeCursor {
+private:
+    const BTreeIndex *index;
+    BTreeNode         leaf;     // a copy of the leaf we're in
+    SIZE_T            offset;   // next entry in leaf
+    bool              atEnd;
+    bool              limited;
+    KEY_T             limit;    // as the nodes keep it
+    
+    ERROR_T Descend(const KEY_T *key);
+    
+public:
+    BTreeCursor(const BTreeIndex &index);
+    
+    // return zero on success, with the cursor at the first key >= key
+    // (or at the end if there is none)
+    // return ERROR_SIZE if the key is the wrong size for this index
+    ERROR_T Seek(const KEY_T &key);
+    
+    // Same, at the smallest key
+    ERROR_T SeekFirst();
+    
+    // Next stops before the first key >= end
+    // return ERROR_SIZE if the key is the wrong size for this index
+    ERROR_T SetLimit(const KEY_T &end);
+    void    ClearLimit();
+    
+    // return zero on success, with the pair under the cursor, and move
+    // past it
+    // return ERROR_NONEXISTENT at the end or the limit
+    ERROR_T Next(KEY_T &key, VALUE_T &value);
+};
+
 #endif
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_bulkload filestem cachesize [fill] < sorted key value pairs\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  double fill=BTREE_BULK_FILL;
+  string key, value;
+  vector<KeyValuePair> pairs;
+
+  if (argc!=3 && argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  if (argc==4) {
+    fill=atof(argv[3]);
+  }
+
+  // One "key value" pair per line, in key order
+  while (cin >> key >> value) {
+    pairs.push_back(KeyValuePair(KEY_T(key.c_str()),VALUE_T(value.c_str())));
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    if ((rc=btree.BulkLoad(pairs,fill))!=ERROR_NOERROR) { 
+      cerr <<"Can't bulk load index due to error "<<rc<<endl;
+    } else {
+      cerr <<"Loaded "<<pairs.size()<<" pairs\n";
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
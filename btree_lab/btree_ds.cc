@@ -5,6 +5,7 @@
 
 #include "btree_ds.h"
 #include "buffercache.h"
+#include "keysearch.h"
 
 #include "btree.h"
 
@@ -12,19 +13,59 @@ using namespace std;
 
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
-  SIZE_T n=blocksize-sizeof(*this);
+  SIZE_T n=blocksize-sizeof(NodeHeader);
+  return n;
+}
+
+
+SIZE_T NodeMetadata::GetStoredKeySize() const
+{
+  return keylen-prefixlen;
+}
+
+
+bool NodeMetadata::IsSampled() const
+{
+  return blocksize>=BTREE_SAMPLED_BLOCKSIZE && !(flags & BTREE_VARLEN);
+}
+
+
+SIZE_T NodeMetadata::GetNumSamples() const
+{
+  if (!IsSampled()) {
+    return 0;
+  }
+  SIZE_T slots = nodetype==BTREE_LEAF_NODE ? GetNumSlotsAsLeaf() : GetNumSlotsAsInterior();
+  return slots/BTREE_SAMPLE_EVERY;
+}
+
+
+SIZE_T NodeMetadata::GetNumSlots(const SIZE_T entrybytes) const
+{
+  SIZE_T room=GetNumDataBytes()-prefixlen-sizeof(SIZE_T);
+  SIZE_T width=GetStoredKeySize();
+
+  if (!IsSampled()) {
+    return room/(width+entrybytes);  // floor intended
+  }
+  // Each slot costs its entry, and every BTREE_SAMPLE_EVERYth one a
+  // sample key on top
+  SIZE_T n=(room*BTREE_SAMPLE_EVERY)/(BTREE_SAMPLE_EVERY*(width+entrybytes)+width);
+  while (n*(width+entrybytes)+(n/BTREE_SAMPLE_EVERY)*width>room) {
+    n--;
+  }
   return n;
 }
 
 
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  return GetNumSlots(sizeof(SIZE_T));
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  return GetNumSlots(valuesize);
 }
 
 
@@ -34,9 +75,11 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" :
+				   nodetype==BTREE_LOG_BLOCK ? "LOG_BLOCK" :
+				   nodetype==BTREE_BLOOM_BLOCK ? "BLOOM_BLOCK" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", valuelog="<<valuelog<<", bloom="<<bloom<<", bloomblocks="<<bloomblocks<<", numkeys="<<numkeys<<", prefixlen="<<prefixlen<<", keylen="<<keylen<<", flags="<<flags<<")";
   return os;
 }
 
@@ -44,11 +87,12 @@ BTreeNode::BTreeNode()
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
   data=0;
+  borrowed=false;
 }
 
 BTreeNode::~BTreeNode()
 {
-  if (data) {
+  if (data && !borrowed) {
     delete [] data;
   }
   data=0;
@@ -56,7 +100,7 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size, SIZE_T flags)
 {
   info.nodetype=node_type;
   info.keysize=key_size;
@@ -64,11 +108,21 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.blocksize=block_size;
   info.rootnode=0;
   info.freelist=0;
+  info.valuelog=0;
+  info.bloom=0;
+  info.bloomblocks=0;
   info.numkeys=0;
+  info.prefixlen=0;
+  info.keylen=key_size;
+  info.flags=flags;
+  if ((flags & BTREE_VALUELOG) && node_type!=BTREE_SUPERBLOCK) {
+    info.valuesize=sizeof(ValueRef);
+  }
   data=0;
+  borrowed=false;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
-    memset(data,0,info.GetNumDataBytes());
+    ClearData();
   }
 }
 
@@ -80,8 +134,15 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.blocksize=rhs.info.blocksize;
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
+  info.valuelog=rhs.info.valuelog;
+  info.bloom=rhs.info.bloom;
+  info.bloomblocks=rhs.info.bloomblocks;
   info.numkeys=rhs.info.numkeys;
+  info.prefixlen=rhs.info.prefixlen;
+  info.keylen=rhs.info.keylen;
+  info.flags=rhs.info.flags;
   data=0;
+  borrowed=false;
   if (rhs.data) {
    data=new char [info.GetNumDataBytes()];
     memcpy(data,rhs.data,info.GetNumDataBytes());
@@ -99,18 +160,68 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
-  Block block(sizeof(info)+info.GetNumDataBytes());
+  Block block(info.blocksize);
 
-  memcpy(block.data,&info,sizeof(info));
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
+  memset(block.data,0,info.blocksize);
+  if (info.nodetype==BTREE_SUPERBLOCK) {
+    memcpy(block.data,&info,sizeof(info));
+  } else {
+    NodeHeader h;
+    h.nodetype=info.nodetype;
+    h.version=info.nodetype==BTREE_LOG_BLOCK ? BTREE_LOG_VERSION : BTREE_NODE_VERSION;
+    h.prefixlen=info.prefixlen;
+    h.keylen=info.keylen;
+    h.reserved=0;
+    h.numkeys=info.numkeys;
+    memcpy(block.data,&h,sizeof(h));
+    memcpy(block.data+sizeof(h),data,info.GetNumDataBytes());
   }
 
   return b->WriteBlock(blocknum,block);
 }
 
 
-ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
+ERROR_T BTreeNode::Decode(const BYTE_T *raw, const NodeMetadata *tree)
+{
+  int nodetype;
+
+  memcpy(&nodetype,raw,sizeof(int));
+  if (nodetype==BTREE_SUPERBLOCK) {
+    memcpy(&info,raw,sizeof(info));
+    return ERROR_NOERROR;
+  }
+
+  NodeHeader h;
+  memcpy(&h,raw,sizeof(h));
+  if (!tree) {
+    // We were expecting a superblock
+    return ERROR_NOTANINDEX;
+  }
+  if (h.version!=(h.nodetype==BTREE_LOG_BLOCK ? BTREE_LOG_VERSION : BTREE_NODE_VERSION)) {
+    return ERROR_INSANE;
+  }
+
+  info.nodetype=h.nodetype;
+  info.keysize=tree->keysize;
+  info.valuesize=tree->valuesize;
+  info.blocksize=tree->blocksize;
+  info.flags=tree->flags;
+  if (info.flags & BTREE_VALUELOG) {
+    info.valuesize=sizeof(ValueRef);
+  }
+  info.rootnode=0;
+  info.freelist=0;
+  info.valuelog=0;
+  info.bloom=0;
+  info.bloomblocks=0;
+  info.numkeys=h.numkeys;
+  info.prefixlen=h.prefixlen;
+  info.keylen=h.keylen;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum, const NodeMetadata *tree)
 {
   Block block;
 
@@ -122,57 +233,116 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
-
-  if (data) {
+  if (data && !borrowed) {
     delete [] data;
-    data=0;
+  }
+  data=0;
+  borrowed=false;
+
+  rc=Decode(block.data,tree);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
   }
 
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+    memcpy(data,block.data+sizeof(NodeHeader),info.GetNumDataBytes());
   }
 
   return ERROR_NOERROR;
 }
 
 
+ERROR_T BTreeNode::View(BufferCache *b, const SIZE_T blocknum, const NodeMetadata *tree, const bool forwrite)
+{
+  Block *frame;
+
+  ERROR_T rc=b->GetBlockFrame(blocknum,frame,forwrite);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  if (data && !borrowed) {
+    delete [] data;
+  }
+  data=0;
+  borrowed=false;
+
+  rc=Decode(frame->data,tree);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+    data=(char*)frame->data+sizeof(NodeHeader);
+    borrowed=true;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+char * BTreeNode::ResolvePrefix() const
+{
+  return data;
+}
+
+
 char * BTreeNode::ResolveKey(const SIZE_T offset) const
 {
-  // cout << "\n The node is of type" << info.nodetype << "\n";
+  if (IsSlotted()) {
+    char *cell=ResolveCell(offset);
+    if (cell==0) {
+      return 0;
+    }
+    return cell+sizeof(SLOT_T)+(info.nodetype==BTREE_LEAF_NODE ? sizeof(SLOT_T) : sizeof(SIZE_T));
+  }
+
   switch (info.nodetype) {
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    // cout << "\nin root node";
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
-    break;
   case BTREE_LEAF_NODE:
-    // cout << "\n in leaf node";
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    return ResolveKeys()+offset*info.GetStoredKeySize();
     break;
   default:
-    // cout << "\n in resolveKey default node";
     return 0;
   }
 }
 
 
-char * BTreeNode::ResolvePtr(const SIZE_T offset) const
+char * BTreeNode::ResolvePtr(const SIZE_T offset, const NodeOps *ops) const
 {
+  if (IsSlotted() && offset>0) {
+    // The leading pointer stays in front; the rest live in the cells
+    if (info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) {
+      return 0;
+    }
+    return ResolveCell(offset-1)+sizeof(SLOT_T);
+  }
+
+  char *base=data+info.prefixlen;
+
   switch (info.nodetype) {
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    if (offset==0) {
+      return base;
+    }
+    if (ops) {
+      return ops->ptrs[info.GetStoredKeySize()](data,info,offset-1);
+    }
+    return ResolveArray()+(offset-1)*sizeof(SIZE_T);
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
-    return data;
+    return base;
     break;
   default:
     return 0;
@@ -181,12 +351,20 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 
 
 
-char * BTreeNode::ResolveVal(const SIZE_T offset) const
+char * BTreeNode::ResolveVal(const SIZE_T offset, const NodeOps *ops) const
 {
   switch (info.nodetype) {
   case BTREE_LEAF_NODE:
+    if (IsSlotted()) {
+      SLOT_T keylen;
+      memcpy(&keylen,ResolveCell(offset),sizeof(SLOT_T));
+      return ResolveKey(offset)+keylen;
+    }
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    if (ops) {
+      return ops->vals[info.GetStoredKeySize()](data,info,offset);
+    }
+    return ResolveArray()+offset*info.valuesize;
     break;
   default:
     return 0;
@@ -195,9 +373,38 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
 
 
 
-char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
+char * BTreeNode::ResolveSamples() const
 {
-  return ResolveKey(offset);
+  return data+info.prefixlen+sizeof(SIZE_T);
+}
+
+
+char * BTreeNode::ResolveKeys() const
+{
+  return ResolveSamples()+info.GetNumSamples()*info.GetStoredKeySize();
+}
+
+
+char * BTreeNode::ResolveArray() const
+{
+  SIZE_T slots = info.nodetype==BTREE_LEAF_NODE ? info.GetNumSlotsAsLeaf() : info.GetNumSlotsAsInterior();
+
+  return ResolveKeys()+slots*info.GetStoredKeySize();
+}
+
+
+//
+// Recopy the samples from group first on, after keys have moved
+//
+void BTreeNode::RefreshSamples(const SIZE_T first)
+{
+  if (!info.IsSampled()) {
+    return;
+  }
+  SIZE_T width=info.GetStoredKeySize();
+  for (SIZE_T g=first;(g+1)*BTREE_SAMPLE_EVERY<=info.numkeys;g++) {
+    memcpy(ResolveSamples()+g*width,ResolveKey((g+1)*BTREE_SAMPLE_EVERY-1),width);
+  }
 }
 
 ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
@@ -208,14 +415,28 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
 
-  k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  if (IsSlotted()) {
+    SLOT_T keylen;
+    memcpy(&keylen,ResolveCell(offset),sizeof(SLOT_T));
+    if (k.length!=keylen) {
+      k.Resize(keylen,false);
+    }
+    memcpy(k.data,p,keylen);
+    return ERROR_NOERROR;
+  }
+
+  if (k.length!=info.keysize) {
+    k.Resize(info.keysize,false);
+  }
+  memcpy(k.data,ResolvePrefix(),info.prefixlen);
+  memcpy(k.data+info.prefixlen,p,info.GetStoredKeySize());
+  memset(k.data+info.keylen,0,info.keysize-info.keylen);
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
+ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr, const NodeOps *ops) const
 {
-  char *p=ResolvePtr(offset);
+  char *p=ResolvePtr(offset,ops);
 
   if (p==0) {
     return ERROR_NOMEM;
@@ -225,16 +446,24 @@ ERROR_T BTreeNode::GetPtr(const SIZE_T offset, SIZE_T &ptr) const
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
+ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v, const NodeOps *ops) const
 {
-  char *p=ResolveVal(offset);
+  char *p=ResolveVal(offset,ops);
 
   if (p==0) {
     return ERROR_NOMEM;
   }
 
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T valuelen=info.valuesize;
+  if (IsSlotted()) {
+    SLOT_T len;
+    memcpy(&len,ResolveCell(offset)+sizeof(SLOT_T),sizeof(SLOT_T));
+    valuelen=len;
+  }
+  if (v.length!=valuelen) {
+    v.Resize(valuelen,false);
+  }
+  memcpy(v.data,p,valuelen);
   return ERROR_NOERROR;
 }
 
@@ -261,7 +490,27 @@ ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  if (IsSlotted()) {
+    // Only in place; a key of another length needs a new cell
+    SLOT_T keylen;
+    memcpy(&keylen,ResolveCell(offset),sizeof(SLOT_T));
+    if (k.length!=keylen) {
+      return ERROR_SIZE;
+    }
+    memcpy(p,k.data,keylen);
+    return ERROR_NOERROR;
+  }
+
+  if (memcmp(ResolvePrefix(),k.data,info.prefixlen) ||
+      SignificantLength(k,info.keysize)>info.keylen) {
+    // Doesn't belong in this node, or is wider than its slots
+    return ERROR_INSANE;
+  }
+
+  memcpy(p,k.data+info.prefixlen,info.GetStoredKeySize());
+  if (info.IsSampled() && (offset+1)%BTREE_SAMPLE_EVERY==0) {
+    memcpy(ResolveSamples()+(offset/BTREE_SAMPLE_EVERY)*info.GetStoredKeySize(),p,info.GetStoredKeySize());
+  }
 
   return ERROR_NOERROR;
 }
@@ -282,15 +531,43 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 
 
 
-ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
+ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v, const NodeOps *ops)
 {
-  char *p=ResolveVal(offset);
+  char *p=ResolveVal(offset,ops);
 
   if (p==0) {
     // cout << " setVal pointer was 0 ";
     return ERROR_NOMEM;
   }
 
+  if (IsSlotted()) {
+    char *cell=ResolveCell(offset);
+    SLOT_T keylen, valuelen;
+    memcpy(&keylen,cell,sizeof(SLOT_T));
+    memcpy(&valuelen,cell+sizeof(SLOT_T),sizeof(SLOT_T));
+    if (v.length==valuelen) {
+      memcpy(p,v.data,valuelen);
+      return ERROR_NOERROR;
+    }
+    // Different size: the pair moves to a new cell, the old one is garbage
+    KEY_T k;
+    GetKey(offset,k);
+    SLOT_T *hdr=ResolveSlots();
+    SLOT_T slot=hdr[2+offset];
+    memmove(hdr+2+offset,hdr+3+offset,(info.numkeys-offset-1)*sizeof(SLOT_T));
+    info.numkeys--;
+    hdr[1]+=CellBytes(info.nodetype,keylen,valuelen)-sizeof(SLOT_T);
+    ERROR_T rc=InsertCell(offset,k,&v,0);
+    if (rc) {
+      // Put the old cell back
+      hdr[1]-=CellBytes(info.nodetype,keylen,valuelen)-sizeof(SLOT_T);
+      memmove(hdr+3+offset,hdr+2+offset,(info.numkeys-offset)*sizeof(SLOT_T));
+      hdr[2+offset]=slot;
+      info.numkeys++;
+    }
+    return rc;
+  }
+
   memcpy(p,v.data,info.valuesize);
 
   return ERROR_NOERROR;
@@ -312,6 +589,646 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+int BTreeNode::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  if (info.flags & BTREE_INTKEYS) {
+    unsigned long long a, b;
+    memcpy(&a,ResolveKey(offset),sizeof(a));
+    memcpy(&b,k.data,sizeof(b));
+    return a<b ? -1 : a>b ? 1 : 0;
+  }
+
+  if (IsSlotted()) {
+    SLOT_T keylen;
+    memcpy(&keylen,ResolveCell(offset),sizeof(SLOT_T));
+    int c=memcmp(ResolveKey(offset),k.data,keylen<k.length ? keylen : k.length);
+    if (c) {
+      return c;
+    }
+    return keylen<k.length ? -1 : keylen>k.length ? 1 : 0;
+  }
+
+  int c=memcmp(ResolvePrefix(),k.data,info.prefixlen);
+
+  if (c) {
+    return c;
+  }
+  c=memcmp(ResolveKey(offset),k.data+info.prefixlen,info.GetStoredKeySize());
+  if (c) {
+    return c;
+  }
+  // Equal as far as the slot goes; the slot's key continues with zeros
+  return SignificantLength(k,info.keysize)>info.keylen ? -1 : 0;
+}
+
+
+SIZE_T BTreeNode::LowerBound(const KEY_T &k, const NodeOps *ops) const
+{
+  return SearchKeys(k,false,ops);
+}
+
+
+SIZE_T BTreeNode::UpperBound(const KEY_T &k, const NodeOps *ops) const
+{
+  return SearchKeys(k,true,ops);
+}
+
+
+SIZE_T BTreeNode::SearchKeys(const KEY_T &k, bool upper, const NodeOps *ops) const
+{
+  if (IsSlotted()) {
+    // Cells are scattered, so a plain binary search through the slots
+    SIZE_T lo=0, hi=info.numkeys;
+    while (lo<hi) {
+      SIZE_T mid=(lo+hi)/2;
+      int c=CompareKey(mid,k);
+      if (c<0 || (upper && c==0)) {
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    return lo;
+  }
+
+  SIZE_T width=info.GetStoredKeySize();
+
+  if (info.numkeys==0) {
+    return 0;
+  }
+
+  // With samples, find the group first: the groups whose last key
+  // (their sample) is before k are wholly before it, and the answer
+  // is within the next one
+  SIZE_T groups = info.IsSampled() ? info.numkeys/BTREE_SAMPLE_EVERY : 0;
+  SIZE_T first=0, n=info.numkeys;
+
+  if (info.flags & BTREE_INTKEYS) {
+    unsigned long long key;
+    memcpy(&key,k.data,sizeof(key));
+    IntSearchFunc kernel = ops ? ops->intsearch : IntSearchBinary;
+    if (groups>1) {
+      first=kernel(ResolveSamples(),groups,key,upper)*BTREE_SAMPLE_EVERY;
+      n = first+BTREE_SAMPLE_EVERY<info.numkeys ? BTREE_SAMPLE_EVERY : info.numkeys-first;
+    }
+    return first+kernel(ResolveKeys()+first*sizeof(key),n,key,upper);
+  }
+
+  // Keys outside the node's prefix sort before or after all of it
+  int c=memcmp(k.data,ResolvePrefix(),info.prefixlen);
+  if (c<0) {
+    return 0;
+  } else if (c>0) {
+    return info.numkeys;
+  }
+
+  // A slot equal to k's first keylen bytes stands for a key that
+  // continues with zeros, so it is < k whenever k's remaining bytes
+  // are not all zero; then keys < k are exactly the keys <= that part
+  if (!upper && SignificantLength(k,info.keysize)>info.keylen) {
+    upper=true;
+  }
+
+  KeySearchFunc kernel = ops ? ops->search[width] : GetKeySearch(width);
+
+  if (groups>1) {
+    first=kernel(ResolveSamples(),width,width,groups,
+		 (const char*)k.data+info.prefixlen,upper)*BTREE_SAMPLE_EVERY;
+    n = first+BTREE_SAMPLE_EVERY<info.numkeys ? BTREE_SAMPLE_EVERY : info.numkeys-first;
+  }
+  return first+kernel(ResolveKeys()+first*width,width,width,n,
+		      (const char*)k.data+info.prefixlen,upper);
+}
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KeyValuePair &p)
+{
+  if (info.nodetype!=BTREE_LEAF_NODE || offset>info.numkeys || !HasRoom(p.key,p.value.length)) {
+    return ERROR_INSANE;
+  }
+
+  if (IsSlotted()) {
+    return InsertCell(offset,p.key,&p.value,0);
+  }
+
+  // One hole in the key array, one in the value array
+  SIZE_T width=info.GetStoredKeySize();
+  char *keyhole=ResolveKeys()+offset*width;
+  char *valhole=ResolveArray()+offset*info.valuesize;
+
+  memmove(keyhole+width,keyhole,(info.numkeys-offset)*width);
+  memmove(valhole+info.valuesize,valhole,(info.numkeys-offset)*info.valuesize);
+  info.numkeys++;
+  RefreshSamples(offset/BTREE_SAMPLE_EVERY);
+
+  return SetKeyVal(offset,p);
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &ptr)
+{
+  if ((info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) ||
+      offset>info.numkeys || !HasRoom(k)) {
+    return ERROR_INSANE;
+  }
+
+  if (IsSlotted()) {
+    return InsertCell(offset,k,0,ptr);
+  }
+
+  // Keys from the ith on move up one in the key array, pointers from
+  // the (i+1)th on one in the pointer array
+  SIZE_T width=info.GetStoredKeySize();
+  char *keyhole=ResolveKeys()+offset*width;
+  char *ptrhole=ResolveArray()+offset*sizeof(SIZE_T);
+
+  memmove(keyhole+width,keyhole,(info.numkeys-offset)*width);
+  memmove(ptrhole+sizeof(SIZE_T),ptrhole,(info.numkeys-offset)*sizeof(SIZE_T));
+  info.numkeys++;
+  RefreshSamples(offset/BTREE_SAMPLE_EVERY);
+
+  ERROR_T rc=SetKey(offset,k);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  return SetPtr(offset+1,ptr);
+}
+
+
+ERROR_T BTreeNode::RemoveKeyVal(const SIZE_T offset)
+{
+  if (info.nodetype!=BTREE_LEAF_NODE || offset>=info.numkeys) {
+    return ERROR_INSANE;
+  }
+
+  if (IsSlotted()) {
+    RemoveCell(offset);
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T width=info.GetStoredKeySize();
+  char *key=ResolveKey(offset);
+  char *val=ResolveVal(offset);
+
+  memmove(key,key+width,(info.numkeys-offset-1)*width);
+  memmove(val,val+info.valuesize,(info.numkeys-offset-1)*info.valuesize);
+  info.numkeys--;
+  RefreshSamples(offset/BTREE_SAMPLE_EVERY);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::RemoveKeyPtr(const SIZE_T offset)
+{
+  if ((info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) ||
+      offset>=info.numkeys) {
+    return ERROR_INSANE;
+  }
+
+  if (IsSlotted()) {
+    RemoveCell(offset);
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T width=info.GetStoredKeySize();
+  char *key=ResolveKey(offset);
+  char *ptr=ResolvePtr(offset+1);
+
+  memmove(key,key+width,(info.numkeys-offset-1)*width);
+  memmove(ptr,ptr+sizeof(SIZE_T),(info.numkeys-offset-1)*sizeof(SIZE_T));
+  info.numkeys--;
+  RefreshSamples(offset/BTREE_SAMPLE_EVERY);
+  return ERROR_NOERROR;
+}
+
+
+bool BTreeNode::IsUnderfull() const
+{
+  if (IsSlotted()) {
+    return 2*FreeBytes()>SlottedCapacity(info.blocksize);
+  }
+  SIZE_T slots = info.nodetype==BTREE_LEAF_NODE ? info.GetNumSlotsAsLeaf() : info.GetNumSlotsAsInterior();
+  return 2*info.numkeys<slots;
+}
+
+
+bool BTreeNode::HasRoom(const KEY_T &k, const SIZE_T valuelen) const
+{
+  if (IsSlotted()) {
+    return FreeBytes()>=CellBytes(info.nodetype,k.length,valuelen);
+  }
+
+  switch (info.nodetype) {
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return info.numkeys<info.GetNumSlotsAsInterior() &&
+      SignificantLength(k,info.keysize)<=info.keylen;
+  case BTREE_LEAF_NODE:
+    return info.numkeys<info.GetNumSlotsAsLeaf();
+  default:
+    return false;
+  }
+}
+
+
+ERROR_T BTreeNode::Unpack(NodeEntries &e) const
+{
+  ERROR_T rc;
+
+  e.nodetype=info.nodetype;
+  e.keys.resize(info.numkeys);
+  e.ptrs.clear();
+  e.vals.clear();
+
+  for (SIZE_T i=0;i<info.numkeys;i++) {
+    rc=GetKey(i,e.keys[i]);
+    if (rc) { return rc; }
+  }
+
+  if (info.nodetype==BTREE_LEAF_NODE) {
+    rc=GetPtr(0,e.link);
+    if (rc) { return rc; }
+    e.vals.resize(info.numkeys);
+    for (SIZE_T i=0;i<info.numkeys;i++) {
+      rc=GetVal(i,e.vals[i]);
+      if (rc) { return rc; }
+    }
+  } else {
+    e.link=0;
+    e.ptrs.resize(info.numkeys+1);
+    for (SIZE_T i=0;i<=info.numkeys;i++) {
+      rc=GetPtr(i,e.ptrs[i]);
+      if (rc) { return rc; }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::SignificantLength(const KEY_T &k, const SIZE_T keysize)
+{
+  SIZE_T n=keysize;
+
+  while (n>0 && k.data[n-1]==0) {
+    n--;
+  }
+  return n;
+}
+
+
+int BTreeNode::CompareKeys(const KEY_T &a, const KEY_T &b, const SIZE_T flags)
+{
+  if (flags & BTREE_INTKEYS) {
+    unsigned long long x, y;
+    memcpy(&x,a.data,sizeof(x));
+    memcpy(&y,b.data,sizeof(y));
+    return x<y ? -1 : x>y ? 1 : 0;
+  }
+
+  // Byte strings, a proper prefix first; for keys of the same length
+  // that is just memcmp
+  int c=memcmp(a.data,b.data,a.length<b.length ? a.length : b.length);
+  if (c) {
+    return c;
+  }
+  return a.length<b.length ? -1 : a.length>b.length ? 1 : 0;
+}
+
+
+void BTreeNode::SwapIntKey(KEY_T &k)
+{
+  unsigned long long v;
+
+  memcpy(&v,k.data,sizeof(v));
+  v=__builtin_bswap64(v);
+  memcpy(k.data,&v,sizeof(v));
+}
+
+
+SIZE_T BTreeNode::FencePrefix(const KEY_T *low, const KEY_T *high, const SIZE_T keysize)
+{
+  // A missing fence is the smallest or largest possible key
+  SIZE_T n=0;
+
+  while (n<keysize) {
+    BYTE_T l = low ? low->data[n] : 0x00;
+    BYTE_T h = high ? high->data[n] : 0xff;
+    if (l!=h) {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+
+ERROR_T BTreeNode::Pack(const NodeEntries &e, const KEY_T *low, const KEY_T *high)
+{
+  ERROR_T rc;
+  SIZE_T n=e.keys.size();
+
+  if (IsSlotted()) {
+    // No prefix; the cells just go in one after the other
+    info.nodetype=e.nodetype;
+    info.prefixlen=0;
+    info.keylen=info.keysize;
+    info.numkeys=0;
+    if (!data || borrowed) {
+      data=new char [info.GetNumDataBytes()];
+      borrowed=false;
+    }
+    ClearData();
+    rc=SetPtr(0,e.nodetype==BTREE_LEAF_NODE ? e.link : e.ptrs[0]);
+    if (rc) { return rc; }
+    for (SIZE_T i=0;i<n;i++) {
+      if (e.nodetype==BTREE_LEAF_NODE) {
+	rc=InsertCell(i,e.keys[i],&e.vals[i],0);
+      } else {
+	rc=InsertCell(i,e.keys[i],0,e.ptrs[i+1]);
+      }
+      if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+  }
+
+  info.nodetype=e.nodetype;
+  info.prefixlen=FencePrefix(low,high,info.keysize);
+  info.keylen=info.keysize;
+  info.numkeys=0;
+
+  if (info.flags & BTREE_INTKEYS) {
+    // Native integers don't sort bytewise
+    info.prefixlen=0;
+  } else if (e.nodetype!=BTREE_LEAF_NODE) {
+    // Slots only as wide as the longest separator needs
+    info.keylen=info.prefixlen;
+    for (SIZE_T i=0;i<n;i++) {
+      SIZE_T len=SignificantLength(e.keys[i],info.keysize);
+      if (len>info.keylen) {
+	info.keylen=len;
+      }
+    }
+  }
+
+  SIZE_T slots = e.nodetype==BTREE_LEAF_NODE ? info.GetNumSlotsAsLeaf() : info.GetNumSlotsAsInterior();
+  if (n>slots) {
+    return ERROR_NOSPACE;
+  }
+
+  if (!data || borrowed) {
+    data=new char [info.GetNumDataBytes()];
+    borrowed=false;
+  }
+  ClearData();
+
+  // With a prefix at least one fence exists, and both have it
+  const KEY_T *fence = low ? low : high;
+  if (fence) {
+    memcpy(ResolvePrefix(),fence->data,info.prefixlen);
+  }
+  info.numkeys=n;
+
+  for (SIZE_T i=0;i<n;i++) {
+    rc=SetKey(i,e.keys[i]);
+    if (rc) { return rc; }
+  }
+
+  if (e.nodetype==BTREE_LEAF_NODE) {
+    rc=SetPtr(0,e.link);
+    if (rc) { return rc; }
+    for (SIZE_T i=0;i<n;i++) {
+      rc=SetVal(i,e.vals[i]);
+      if (rc) { return rc; }
+    }
+  } else {
+    for (SIZE_T i=0;i<=n;i++) {
+      rc=SetPtr(i,e.ptrs[i]);
+      if (rc) { return rc; }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+SLOT_T * BTreeNode::ResolveSlots() const
+{
+  return (SLOT_T*)(data+sizeof(SIZE_T));
+}
+
+
+char * BTreeNode::ResolveCell(const SIZE_T offset) const
+{
+  if (offset>=info.numkeys) {
+    return 0;
+  }
+  return data+ResolveSlots()[2+offset];
+}
+
+
+SIZE_T BTreeNode::CellBytes(const int nodetype, const SIZE_T keylen, const SIZE_T valuelen)
+{
+  if (nodetype==BTREE_LEAF_NODE) {
+    return 3*sizeof(SLOT_T)+keylen+valuelen;
+  } else {
+    return 2*sizeof(SLOT_T)+sizeof(SIZE_T)+keylen;
+  }
+}
+
+
+SIZE_T BTreeNode::SlottedCapacity(const SIZE_T blocksize)
+{
+  return blocksize-sizeof(NodeHeader)-sizeof(SIZE_T)-2*sizeof(SLOT_T);
+}
+
+
+SIZE_T BTreeNode::FreeBytes() const
+{
+  SLOT_T *hdr=ResolveSlots();
+  char *slotend=(char*)(hdr+2+info.numkeys);
+
+  return (data+hdr[0])-slotend+hdr[1];
+}
+
+
+void BTreeNode::ClearData()
+{
+  memset(data,0,info.GetNumDataBytes());
+  if (IsSlotted()) {
+    ResolveSlots()[0]=info.GetNumDataBytes();
+  }
+}
+
+
+//
+// Squeeze out the garbage: rewrite the cells, in key order, packed
+// against the end of the node
+//
+void BTreeNode::Compact()
+{
+  SIZE_T n=info.GetNumDataBytes();
+  char *copy=new char [n];
+  SLOT_T *hdr=ResolveSlots();
+  SIZE_T top=n;
+
+  for (SIZE_T i=0;i<info.numkeys;i++) {
+    char *cell=ResolveCell(i);
+    SLOT_T keylen, valuelen=0;
+    memcpy(&keylen,cell,sizeof(SLOT_T));
+    if (info.nodetype==BTREE_LEAF_NODE) {
+      memcpy(&valuelen,cell+sizeof(SLOT_T),sizeof(SLOT_T));
+    }
+    SIZE_T len=CellBytes(info.nodetype,keylen,valuelen)-sizeof(SLOT_T);
+    top-=len;
+    memcpy(copy+top,cell,len);
+    hdr[2+i]=top;
+  }
+  memcpy(data+top,copy+top,n-top);
+  hdr[0]=top;
+  hdr[1]=0;
+  delete [] copy;
+}
+
+
+//
+// Drop the ith key's slot; its cell becomes garbage
+//
+void BTreeNode::RemoveCell(const SIZE_T offset)
+{
+  SLOT_T *hdr=ResolveSlots();
+  char *cell=ResolveCell(offset);
+  SLOT_T keylen, valuelen=0;
+
+  memcpy(&keylen,cell,sizeof(SLOT_T));
+  if (info.nodetype==BTREE_LEAF_NODE) {
+    memcpy(&valuelen,cell+sizeof(SLOT_T),sizeof(SLOT_T));
+  }
+  hdr[1]+=CellBytes(info.nodetype,keylen,valuelen)-sizeof(SLOT_T);
+  memmove(hdr+2+offset,hdr+3+offset,(info.numkeys-offset-1)*sizeof(SLOT_T));
+  info.numkeys--;
+}
+
+
+//
+// Add a cell for k (and v in a leaf, ptr in an interior node) as the
+// ith key, compacting first if the free space is all fragments
+//
+ERROR_T BTreeNode::InsertCell(const SIZE_T offset, const KEY_T &k, const VALUE_T *v, const SIZE_T ptr)
+{
+  bool leaf=info.nodetype==BTREE_LEAF_NODE;
+  SIZE_T valuelen = leaf ? v->length : 0;
+  SIZE_T need=CellBytes(info.nodetype,k.length,valuelen);
+
+  if (FreeBytes()<need) {
+    return ERROR_NOSPACE;
+  }
+
+  SLOT_T *hdr=ResolveSlots();
+  char *slotend=(char*)(hdr+2+info.numkeys);
+  if ((SIZE_T)((data+hdr[0])-slotend)<need) {
+    Compact();
+  }
+
+  SLOT_T keylen=k.length;
+  hdr[0]-=need-sizeof(SLOT_T);
+  char *cell=data+hdr[0];
+  memcpy(cell,&keylen,sizeof(SLOT_T));
+  if (leaf) {
+    SLOT_T len=valuelen;
+    memcpy(cell+sizeof(SLOT_T),&len,sizeof(SLOT_T));
+    memcpy(cell+2*sizeof(SLOT_T),k.data,keylen);
+    memcpy(cell+2*sizeof(SLOT_T)+keylen,v->data,valuelen);
+  } else {
+    memcpy(cell+sizeof(SLOT_T),&ptr,sizeof(SIZE_T));
+    memcpy(cell+sizeof(SLOT_T)+sizeof(SIZE_T),k.data,keylen);
+  }
+
+  memmove(hdr+3+offset,hdr+2+offset,(info.numkeys-offset)*sizeof(SLOT_T));
+  hdr[2+offset]=cell-data;
+  info.numkeys++;
+  return ERROR_NOERROR;
+}
+
+
+//
+// ResolveArray()+i*entry for a node whose stored key width is W and
+// whose entries are E bytes.  Unsampled nodes (the common case) get
+// the slot count by dividing by a constant; sampled ones are large
+// enough that GetNumSlots' search for it hardly matters.
+//
+template <SIZE_T W, SIZE_T E>
+static char *EntryFixed(const char *data, const NodeMetadata &info, const SIZE_T i)
+{
+  SIZE_T slots, samples=0;
+
+  if (info.IsSampled()) {
+    slots=info.GetNumSlots(E);
+    samples=slots/BTREE_SAMPLE_EVERY;
+  } else {
+    slots=(info.GetNumDataBytes()-info.prefixlen-sizeof(SIZE_T))/(W+E);
+  }
+  return (char*)data+info.prefixlen+sizeof(SIZE_T)+(samples+slots)*W+i*E;
+}
+
+
+// Any width and entry size, worked out from info
+static char *EntryAny(const char *data, const NodeMetadata &info, const SIZE_T i)
+{
+  SIZE_T entry = info.nodetype==BTREE_LEAF_NODE ? info.valuesize : sizeof(SIZE_T);
+  SIZE_T slots = info.GetNumSlots(entry);
+  SIZE_T width = info.GetStoredKeySize();
+
+  return (char*)data+info.prefixlen+sizeof(SIZE_T)+(info.GetNumSamples()+slots)*width+i*entry;
+}
+
+
+template <SIZE_T E>
+static NodeEntryFunc GetEntryFixed(const SIZE_T width)
+{
+  static const NodeEntryFunc fixed[KEYSEARCH_MAXFIXED+1] = {
+    EntryFixed<0,E>,
+    EntryFixed<1,E>,  EntryFixed<2,E>,  EntryFixed<3,E>,  EntryFixed<4,E>,
+    EntryFixed<5,E>,  EntryFixed<6,E>,  EntryFixed<7,E>,  EntryFixed<8,E>,
+    EntryFixed<9,E>,  EntryFixed<10,E>, EntryFixed<11,E>, EntryFixed<12,E>,
+    EntryFixed<13,E>, EntryFixed<14,E>, EntryFixed<15,E>, EntryFixed<16,E>,
+  };
+
+  if (width<=KEYSEARCH_MAXFIXED) {
+    return fixed[width];
+  }
+  return EntryAny;
+}
+
+
+void NodeOps::Init(const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T flags)
+{
+  // What a leaf actually holds per key
+  SIZE_T leafvaluesize = flags & BTREE_VALUELOG ? sizeof(ValueRef) : valuesize;
+
+  search.resize(keysize+1);
+  ptrs.resize(keysize+1);
+  vals.resize(keysize+1);
+  for (SIZE_T w=0;w<=keysize;w++) {
+    search[w]=GetKeySearchFixed(w);
+    ptrs[w]=GetEntryFixed<sizeof(SIZE_T)>(w);
+    switch (leafvaluesize) {
+    case 4:
+      vals[w]=GetEntryFixed<4>(w);
+      break;
+    case 8:
+      vals[w]=GetEntryFixed<8>(w);
+      break;
+    case 16:
+      vals[w]=GetEntryFixed<16>(w);
+      break;
+    default:
+      vals[w]=EntryAny;
+      break;
+    }
+  }
+  intsearch = flags & BTREE_INTERPOLATE ? IntSearchInterpolation : IntSearchBinary;
+}
+
+
 ostream & BTreeNode::Print(ostream &os) const
 {
   os << "BTreeNode(info="<<info;
@@ -2,8 +2,10 @@
 #define _btree_ds
 
 #include <iostream>
+#include <vector>
 #include "global.h"
 #include "block.h"
+#include "keysearch.h"
 
 using namespace std;
 
@@ -13,6 +15,27 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_LOG_BLOCK 5  // holds values for a BTREE_VALUELOG index
+#define BTREE_BLOOM_BLOCK 6 // part of a BTREE_BLOOM index's filter
+
+// Nodes at least this big get a sample array, one sample per
+// BTREE_SAMPLE_EVERY keys
+#define BTREE_SAMPLED_BLOCKSIZE 16384
+#define BTREE_SAMPLE_EVERY 32
+
+// Index format flags, kept in the superblock
+#define BTREE_VARLEN 0x1   // keys and values of any length up to keysize/valuesize
+#define BTREE_INTKEYS 0x2  // 8 byte big-endian integer keys, kept as native integers
+#define BTREE_INTERPOLATE 0x4 // with BTREE_INTKEYS, search nodes by interpolation
+#define BTREE_VALUELOG 0x8 // values live in log blocks, leaves hold ValueRefs
+#define BTREE_BLOOM 0x10   // a Bloom filter of the keys lets misses skip the tree
+#define BTREE_BSTAR 0x20   // full nodes spill into a neighbour, and split 2-to-3
+
+// A BTREE_BLOOM index's filter takes 1/BTREE_BLOOM_FRACTION of the
+// disk, and sets BTREE_BLOOM_PROBES bits per key
+#define BTREE_BLOOM_FRACTION 64
+#define BTREE_BLOOM_PROBES 4
+
 
 
 typedef Block Buffer;
@@ -30,12 +53,22 @@ struct NodeMetadata {
   SIZE_T valuesize;
   SIZE_T blocksize;
   SIZE_T rootnode; //meaningful only for superblock
-  SIZE_T freelist; //meaningful only for superblock or a free block
+  SIZE_T freelist; //meaningful only for superblock: where AllocateNode starts looking, every block before it is in use
+  SIZE_T valuelog; //meaningful only for superblock: the log block values are appended to, 0 if none yet
+  SIZE_T bloom;    //meaningful only for superblock: first block of the filter (BTREE_BLOOM)
+  SIZE_T bloomblocks; //meaningful only for superblock: blocks in the filter
   SIZE_T numkeys;
+  SIZE_T prefixlen; //key bytes shared by the whole node, stored once
+  SIZE_T keylen;    //leading key bytes that are significant in this node (see below)
+  SIZE_T flags;     //index format (BTREE_VARLEN), the same in every node
 
   SIZE_T GetNumDataBytes() const;
+  SIZE_T GetStoredKeySize() const; // bytes of each key kept per slot
+  SIZE_T GetNumSlots(const SIZE_T entrybytes) const; // with entrybytes of pointer or value per key
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  bool   IsSampled() const;       // true if the node has a sample array (see below)
+  SIZE_T GetNumSamples() const;   // room in the sample array
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -45,22 +78,140 @@ struct NodeMetadata {
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
 
+//
+// On disk only the superblock holds a whole NodeMetadata.  Every other
+// block starts with this instead, since keysize, valuesize, blocksize
+// and flags are the same for the whole tree and rootnode means nothing
+// outside the superblock.  Free blocks aren't written at all.  The
+// header is versioned so the layout can change again.
+//
+#define BTREE_NODE_VERSION 1
+
+struct NodeHeader {
+  BYTE_T         nodetype;
+  BYTE_T         version;
+  unsigned short prefixlen;
+  unsigned short keylen;
+  unsigned short reserved;
+  SIZE_T         numkeys;
+};
+
+
 
 //
 // Interior node:
 //
-// PTR KEY PTR KEY PTR KEY PTR
+// PREFIX PTR KEY KEY KEY ... PTR PTR PTR ...
 //
 // Leaf:
 //
-// PTR* KEY VALUE KEY VALUE KEY VALUE
+// PREFIX PTR* KEY KEY KEY ... VALUE VALUE VALUE ...
+//
+// *Here this pointer links to the next leaf in key order, or is 0 in
+// the last one (block 0 is always the superblock)
+//
+// The keys are one contiguous array so that searching a node only
+// touches key bytes.  The key array has room for as many keys as the
+// node can hold (GetNumSlotsAs*), and the pointers after the first, or
+// the values, follow it in the same order as the keys.
+//
+// Nodes of BTREE_SAMPLED_BLOCKSIZE bytes or more hold thousands of
+// keys, and a binary search over those misses cache on nearly every
+// probe.  Such nodes also keep a copy of every BTREE_SAMPLE_EVERYth key
+// (the last key of each group) in a sample array just before the key
+// array:
+//
+// PREFIX PTR SAMPLE SAMPLE ... KEY KEY KEY ... PTR/VALUE ...
+//
+// A search goes through the small sample array first and then only
+// one group of keys, touching a few cache lines rather than one per
+// probe.  Slotted nodes don't have samples.
+//
+// PREFIX is the first info.prefixlen bytes that every key in the node
+// shares; each KEY slot only holds the remaining bytes.  The prefix
+// is the common prefix of the node's fence keys (the parent separators
+// around it), so every key that can ever land in the node has it, and
+// it only changes when the node itself is split or rebuilt (Pack).
+//
+// Separators in interior nodes are suffix-truncated: only as many
+// bytes as it takes to tell the two halves of a split apart, the rest
+// implicitly zero.  info.keylen is the longest such separator in the
+// node, and each slot holds key bytes [prefixlen, keylen).  Leaves
+// always have keylen==keysize.
+//
+// Variable length (BTREE_VARLEN) indexes use a slotted page instead:
+//
+// PTR CELLSTART GARBAGE SLOT SLOT SLOT ... free ... CELL CELL CELL
+//
+// SLOT i is the offset (from data) of the ith key's cell, in key order;
+// cells are allocated downwards from the end of the node, CELLSTART
+// being the lowest one.  Cells that have been replaced leave GARBAGE
+// bytes behind, which are reclaimed by compacting the node in place
+// when the free space between the slots and the cells runs out.
+//
+// Interior cell: KEYLEN PTR KEY   (PTR is the pointer after KEY)
+// Leaf cell:     KEYLEN VALUELEN KEY VALUE
+//
+// Keys compare as byte strings, a proper prefix sorting first.  There
+// is no node prefix (prefixlen==0) and separators are simply stored
+// as long as they are.  Offsets and lengths are SLOT_Ts, so such nodes
+// are limited to 64KB.
+//
+// Integer key (BTREE_INTKEYS) indexes keep each key as a native
+// unsigned 64 bit integer, swapped from big-endian as it comes in
+// through BTreeIndex, so nodes compare keys as integers.  As native
+// bytes don't sort like the integers do, these nodes have no prefix
+// and no truncated separators (prefixlen==0, keylen==keysize).
 //
-// *Here this pointer is not used
+typedef unsigned short SLOT_T;
+
+
+//
+// In a BTREE_VALUELOG index the values are appended to log blocks,
+// and each leaf value is just a ValueRef to where it is.  A log
+// block's data is
+//
+// LIVE VALUE VALUE VALUE ...
+//
+// LIVE (a SIZE_T) counts the values in the block that a leaf still
+// refers to, and the header's numkeys is the number of bytes used,
+// LIVE included.  Values are overwritten in place when their size
+// stays the same; otherwise the new value is appended and the old
+// copy is released.  A block goes back to the free blocks when its
+// last value is released, unless it is the one being appended to,
+// which just starts over.  The leaf code sees ValueRefs as ordinary
+// values of sizeof(ValueRef) bytes, which is what info.valuesize is
+// in such an index's nodes.
+//
+// Log blocks got LIVE in version BTREE_LOG_VERSION of the header; a
+// log block of an older version is not read.
+//
+#define BTREE_LOG_VERSION 2
+
+struct ValueRef {
+  SIZE_T         block;
+  unsigned short offset;
+  unsigned short length;
+};
+
+
+struct NodeOps;
+
+// A node decoded into plain arrays of full keys.  Anything that
+// reshapes nodes (splits) works on these and re-encodes with Pack.
+struct NodeEntries {
+  int             nodetype;
+  SIZE_T          link;  // leaf: the next leaf
+  vector<KEY_T>   keys;
+  vector<SIZE_T>  ptrs;  // interior: keys.size()+1 of them
+  vector<VALUE_T> vals;  // leaf: one per key
+};
 
 
 struct BTreeNode {
   NodeMetadata  info;
   char         *data;
+  bool          borrowed; // data points into a cache frame (see View)
   //
   // unallocated or superblock => blank
   // interior => array of keys
@@ -74,38 +225,116 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size, SIZE_T flags=0);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
-  ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
-
-  char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
-  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
-  char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
-  char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  // Nodes other than the superblock only carry a NodeHeader, so tree
+  // (the superblock's metadata) supplies the rest of info; it may be 0
+  // only when reading the superblock itself.
+  ERROR_T Unserialize(BufferCache *b, const SIZE_T block, const NodeMetadata *tree=0);
+  // Zero-copy alternative to Unserialize: data points straight into
+  // the cached block, which is only good until the next cache miss.
+  // With forwrite, changes to the keys/ptrs/values land directly in
+  // the (now dirty) cached block; changes to info are not written back.
+  ERROR_T View(BufferCache *b, const SIZE_T block, const NodeMetadata *tree=0, const bool forwrite=false);
+
+  char *ResolvePrefix() const; // Gives a pointer to the shared key prefix
+  char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key's stored suffix (interior or leaf)
+  // ops (the index's NodeOps, may be 0) gives the specialized locators
+  char *ResolvePtr(const SIZE_T offset, const NodeOps *ops=0) const; // Gives a pointer to the ith pointer (interior)
+  char *ResolveVal(const SIZE_T offset, const NodeOps *ops=0) const; // Gives a pointer to the ith value (leaf)
+  char *ResolveSamples() const; // Gives a pointer to the sample array (large nodes)
+  char *ResolveKeys() const; // Gives a pointer to the key array
+  char *ResolveArray() const; // Gives a pointer to the pointer (interior) or value (leaf) array after the keys
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
-  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
-  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
+  ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p, const NodeOps *ops=0) const ;   // Gives the ith pointer (interior)
+  ERROR_T GetVal(const SIZE_T offset, VALUE_T &v, const NodeOps *ops=0) const ; // Gives  the ith value (leaf)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
 
 
-  ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
+  ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf), which must have the node's prefix
   ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
-  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
+  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v, const NodeOps *ops=0); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // Binary search over the keys of this node (interior or leaf),
+  // comparing in place without copying keys out.  The prefix is
+  // compared once, then only the stored suffixes; ops supplies the
+  // per-index kernels and may be 0.
+  int    CompareKey(const SIZE_T offset, const KEY_T &k) const; // <0, 0, >0 like memcmp(ith key, k)
+  SIZE_T LowerBound(const KEY_T &k, const NodeOps *ops=0) const; // first offset whose key is >= k (numkeys if none)
+  SIZE_T UpperBound(const KEY_T &k, const NodeOps *ops=0) const; // first offset whose key is >  k (numkeys if none)
+  SIZE_T SearchKeys(const KEY_T &k, const bool upper, const NodeOps *ops=0) const; // either bound, via the keysearch kernels
+
+  // Open a hole with a single memmove and fill it; numkeys grows by one
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KeyValuePair &p); // leaf: pair becomes the ith
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &ptr); // interior: k becomes the ith key, ptr the (i+1)th pointer
+  // Close the hole again; numkeys shrinks by one
+  ERROR_T RemoveKeyVal(const SIZE_T offset); // leaf: drop the ith pair
+  ERROR_T RemoveKeyPtr(const SIZE_T offset); // interior: drop the ith key and the (i+1)th pointer
+  bool    IsUnderfull() const; // less than half full, a candidate for merging
+  bool    HasRoom(const KEY_T &k, const SIZE_T valuelen=0) const; // true if k (with a valuelen byte value, leaf) fits as the node is encoded now
+
+  // Decode the node into full keys, and (re)encode one from scratch.
+  // low and high are the node's fence keys, 0 meaning unbounded; the
+  // prefix is derived from them.  Pack fails with ERROR_NOSPACE if
+  // the entries don't fit.
+  ERROR_T Unpack(NodeEntries &e) const;
+  ERROR_T Pack(const NodeEntries &e, const KEY_T *low, const KEY_T *high);
+  static SIZE_T FencePrefix(const KEY_T *low, const KEY_T *high, const SIZE_T keysize);
+  static SIZE_T SignificantLength(const KEY_T &k, const SIZE_T keysize); // k without its trailing zero bytes
+  static int    CompareKeys(const KEY_T &a, const KEY_T &b, const SIZE_T flags); // <0, 0, >0 in the order of an index with these flags
+  static void   SwapIntKey(KEY_T &k); // big-endian <-> native, for BTREE_INTKEYS
+
+  // Slotted page (BTREE_VARLEN) support
+  bool    IsSlotted() const { return info.flags & BTREE_VARLEN; }
+  SLOT_T *ResolveSlots() const; // CELLSTART, GARBAGE, then one SLOT per key
+  char   *ResolveCell(const SIZE_T offset) const; // the ith key's cell
+  SIZE_T  FreeBytes() const; // free space, counting garbage
+  static SIZE_T CellBytes(const int nodetype, const SIZE_T keylen, const SIZE_T valuelen); // a cell and its slot
+  static SIZE_T SlottedCapacity(const SIZE_T blocksize); // cell and slot bytes an empty slotted node holds
+
   ostream &Print(ostream &rhs) const;
+
+private:
+  ERROR_T Decode(const BYTE_T *raw, const NodeMetadata *tree);
+  void    ClearData();
+  void    RefreshSamples(const SIZE_T first);
+  void    RemoveCell(const SIZE_T offset);
+  void    Compact();
+  ERROR_T InsertCell(const SIZE_T offset, const KEY_T &k, const VALUE_T *v, const SIZE_T ptr);
 };
 
 
 inline ostream & operator<<(ostream &os, const BTreeNode &node) { return node.Print(os); }
 
 
+//
+// Gives a pointer to the ith entry of a fixed-width node's pointer
+// (interior, the pointers after the first) or value (leaf) array.
+//
+typedef char *(*NodeEntryFunc)(const char *data, const NodeMetadata &info, const SIZE_T i);
 
+//
+// Per-index search kernels and entry locators, one per stored key
+// width a node of this index can have (prefix compression makes that
+// vary by node), each specialized at compile time for its width where
+// possible.  The locators also fix the pointer stride and, for 4, 8
+// and 16 byte leaf values, the value stride, so finding the array
+// after the keys divides by a constant instead of working out the
+// slot count at run time.  Built once when the index is attached.
+//
+struct NodeOps {
+  vector<KeySearchFunc> search; // indexed by stored key width, 0..keysize
+  IntSearchFunc         intsearch; // for BTREE_INTKEYS
+  vector<NodeEntryFunc> ptrs; // interior, indexed by stored key width
+  vector<NodeEntryFunc> vals; // leaf, likewise
 
+  void Init(const SIZE_T keysize, const SIZE_T valuesize, const SIZE_T flags=0);
+};
 
 
 #endif
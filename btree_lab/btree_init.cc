@@ -4,7 +4,7 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [-varlen] [-intkeys [-interpolate]] [-valuelog] [-bloom] [-bstar]\n";
 }
 
 
@@ -13,12 +13,32 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  SIZE_T flags=0;
 
-  if (argc!=5) { 
+  if (argc<5) { 
     usage();
     return -1;
   }
 
+  for (int i=5;i<argc;i++) { 
+    if (!strcmp(argv[i],"-varlen")) { 
+      flags|=BTREE_VARLEN;
+    } else if (!strcmp(argv[i],"-intkeys")) { 
+      flags|=BTREE_INTKEYS;
+    } else if (!strcmp(argv[i],"-interpolate")) { 
+      flags|=BTREE_INTERPOLATE;
+    } else if (!strcmp(argv[i],"-valuelog")) { 
+      flags|=BTREE_VALUELOG;
+    } else if (!strcmp(argv[i],"-bloom")) { 
+      flags|=BTREE_BLOOM;
+    } else if (!strcmp(argv[i],"-bstar")) { 
+      flags|=BTREE_BSTAR;
+    } else {
+      usage();
+      return -1;
+    }
+  }
+
   filestem=argv[1];
   cachesize=atoi(argv[2]);
   keysize=atoi(argv[3]);
@@ -26,7 +46,7 @@ int main(int argc, char **argv)
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,true,flags);
   
   ERROR_T rc;
 
@@ -61,6 +61,11 @@ BufferCache::~BufferCache()
 ERROR_T BufferCache::Attach()
 {
   blockmap.clear();
+  // A disk that failed to open (missing or corrupt) comes up with no
+  // blocks at all
+  if (disk->GetNumBlocks()==0) { 
+    return ERROR_BADCONFIG;
+  }
   return ERROR_NOERROR;
 }
 
@@ -84,7 +89,7 @@ ERROR_T BufferCache::Detach()
     }
   }
   blockmap.clear();
-  return ERROR_NOERROR;
+  return FlushAllocations();
 }
 
 
@@ -118,6 +123,9 @@ ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
   deallocs++;
+  // Its contents are dead, so a dirty copy is dropped rather than
+  // written back (which would fill a punched hole again)
+  blockmap.erase(inblocknum);
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
 
@@ -127,6 +135,11 @@ bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
   return disk->IsBlockAllocated(inblocknum);
 }
 
+ERROR_T BufferCache::FlushAllocations()
+{
+  return disk->FlushBitMap();
+}
+
 
 ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
 {
@@ -197,6 +210,44 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
   }
 }
   
+ERROR_T BufferCache::GetBlockFrame(const SIZE_T inblocknum, Block *&frame, const bool forwrite)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(inblocknum);
+
+  if (b==blockmap.end()) {
+    // Not in cache, so bring it in and hand out the new frame
+    CheckDeleteOldest();
+    if (!(disk->IsBlockAllocated(inblocknum))) { 
+      if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
+	cerr << "BufferCache::GetBlockFrame: Attempt to read unallocated block " << inblocknum<<endl;
+      }
+    }
+    Block myblock;
+    double reqtime;
+    int rc = disk->Read(inblocknum,
+			myblock,
+			reqtime);
+    curtime+=reqtime;
+    diskreads++;
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    myblock.dirty=false;
+    b = blockmap.insert(make_pair(inblocknum,myblock)).first;
+  }
+  
+  frame=&((*b).second);
+  frame->lastaccessed=curtime;
+  reads++;
+  if (forwrite) {
+    frame->dirty=true;
+    writes++;
+  }
+  return ERROR_NOERROR;
+}
+  
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
   // Not implemented yet
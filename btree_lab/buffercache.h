@@ -42,6 +42,7 @@ class BufferCache {
 
   // Call Attach before your first read or write
   // Call Detach after your last read or write
+  // Detach writes back all dirty blocks and then flushes allocations
   ERROR_T Attach();
   ERROR_T Detach();
 
@@ -61,6 +62,8 @@ class BufferCache {
   ERROR_T NotifyDeallocateBlock(const SIZE_T inblocknum);
   // check to see if we think the block was allocated
   bool  IsBlockAllocated(const SIZE_T inblocknum);
+  // make the allocation notifications so far durable
+  ERROR_T FlushAllocations();
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
@@ -70,6 +73,13 @@ class BufferCache {
   // ERROR_NOSUCHBLOCK
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
+
+  // Like ReadBlock, but hands back the cached frame itself rather
+  // than a copy.  The frame stays valid only until the next cache
+  // miss (which may evict it), so use it before touching another
+  // block.  With forwrite the frame is marked dirty and may be
+  // modified in place, but not resized.
+  ERROR_T GetBlockFrame(const SIZE_T inblocknum, Block *&frame, const bool forwrite=false);
   
   // Request that a block be read into the cache
   // This returns immediately.
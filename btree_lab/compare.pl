@@ -20,7 +20,7 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
     # spans multiple output lines, each of which needs to be checked.
     # it must be the case that both implementations found this was OK.
 
-    undef %refcontent if defined(%refcontent);
+    %refcontent=();
     while (1) {
       $disp=<REF>; chomp($disp);
       last if $disp=~/END DISPLAY/;
@@ -28,7 +28,7 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
       $refcontent{$1}=$2;
     }
       
-    undef %testcontent if defined(%testcontent);
+    %testcontent=();
     while (1) {
       $disp=<TEST>; chomp($disp);
       last if $disp=~/END DISPLAY/;
@@ -73,6 +73,116 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
       }
     }
     $numerr++ if $sawerror;
+  } elsif ($cmd =~ /^RANGE/) {
+    # RANGE also spans multiple lines, if it succeeds, and unlike
+    # DISPLAY the pairs must come out in order
+    @refrange=();
+    if ($ref =~ /BEGIN RANGE/) {
+      while (1) {
+	$disp=<REF>; chomp($disp);
+	last if $disp=~/END RANGE/;
+	$disp=~/\((\S+)\s*,\s*(\S+)\)/;
+	push @refrange, "($1,$2)";
+      }
+    }
+
+    @testrange=();
+    if ($test =~ /BEGIN RANGE/) {
+      while (1) {
+	$disp=<TEST>; chomp($disp);
+	last if $disp=~/END RANGE/;
+	$disp=~/\((\S+)\s*,\s*(\S+)\)/;
+	push @testrange, "($1,$2)";
+      }
+    }
+
+    $sawerror=0;
+
+    if ($ref ne $test) {
+      print "----------------------------------------------------------------------------\n";
+      print "ERROR $numerr found on operation $i\n\n";
+      print "Operation is \"$cmd\"\n\n";
+      print "Reference implementation says: \"$ref\"\n";
+      print "Test implementation says:      \"$test\"\n";
+      print "----------------------------------------------------------------------------\n";
+      $sawerror=1;
+    } elsif ($#refrange!=$#testrange) {
+      print "----------------------------------------------------------------------------\n";
+      print "ERROR $numerr found on operation $i\n\n";
+      print "Operation is \"$cmd\"\n\n";
+      print "Reference implementation has ".($#refrange+1)." keys in the range\n";
+      print "Test implementation has ".($#testrange+1)." keys in the range\n";
+      print "----------------------------------------------------------------------------\n";
+      $sawerror=1;
+    } else {
+      for ($j=0;$j<=$#refrange;$j++) {
+	if ($refrange[$j] ne $testrange[$j]) {
+	  print "----------------------------------------------------------------------------\n";
+	  print "ERROR $numerr found on operation $i\n\n";
+	  print "Operation is \"$cmd\"\n\n";
+	  print "Reference implementation has $refrange[$j] at position $j\n";
+	  print "Test implementation has      $testrange[$j] at position $j\n";
+	  print "----------------------------------------------------------------------------\n";
+	  $sawerror=1;
+	  last;
+	}
+      }
+    }
+    $numerr++ if $sawerror;
+  } elsif ($cmd =~ /^((INSERT|LOOKUP)BATCH)/) {
+    # A batch gets one reply line per pair or key, in the order given
+    $batch=$1;
+    @refbatch=();
+    if ($ref =~ /BEGIN $batch/) {
+      while (1) {
+	$disp=<REF>; chomp($disp);
+	last if $disp=~/END $batch/;
+	push @refbatch, $disp;
+      }
+    }
+
+    @testbatch=();
+    if ($test =~ /BEGIN $batch/) {
+      while (1) {
+	$disp=<TEST>; chomp($disp);
+	last if $disp=~/END $batch/;
+	push @testbatch, $disp;
+      }
+    }
+
+    $sawerror=0;
+
+    if ($ref ne $test) {
+      print "----------------------------------------------------------------------------\n";
+      print "ERROR $numerr found on operation $i\n\n";
+      print "Operation is \"$cmd\"\n\n";
+      print "Reference implementation says: \"$ref\"\n";
+      print "Test implementation says:      \"$test\"\n";
+      print "----------------------------------------------------------------------------\n";
+      $sawerror=1;
+    } elsif ($#refbatch!=$#testbatch) {
+      print "----------------------------------------------------------------------------\n";
+      print "ERROR $numerr found on operation $i\n\n";
+      print "Operation is \"$cmd\"\n\n";
+      print "Reference implementation has ".($#refbatch+1)." replies in the batch\n";
+      print "Test implementation has ".($#testbatch+1)." replies in the batch\n";
+      print "----------------------------------------------------------------------------\n";
+      $sawerror=1;
+    } else {
+      for ($j=0;$j<=$#refbatch;$j++) {
+	if ($refbatch[$j] ne $testbatch[$j]) {
+	  print "----------------------------------------------------------------------------\n";
+	  print "ERROR $numerr found on operation $i\n\n";
+	  print "Operation is \"$cmd\"\n\n";
+	  print "Reference implementation says \"$refbatch[$j]\" for item $j\n";
+	  print "Test implementation says      \"$testbatch[$j]\" for item $j\n";
+	  print "----------------------------------------------------------------------------\n";
+	  $sawerror=1;
+	  last;
+	}
+      }
+    }
+    $numerr++ if $sawerror;
   } else {
     if ($ref ne $test) { 
       print "----------------------------------------------------------------------------\n";
@@ -0,0 +1,84 @@
+#include <string.h>
+
+#include "compress.h"
+
+#define MAXLITERAL 128
+#define MINRUN     3
+#define MAXRUN     (0x7f+MINRUN)
+
+
+SIZE_T CompressBlock(const BYTE_T *in, const SIZE_T len, BYTE_T *out, const SIZE_T outcap)
+{
+  SIZE_T i=0;
+  SIZE_T o=0;
+  SIZE_T litstart=0;
+  SIZE_T numlit=0;
+
+#define FLUSHLITERALS                                   \
+  do {                                                  \
+    if (numlit>0) {                                     \
+      if (o+1+numlit>outcap) { return 0; }              \
+      out[o++]=(BYTE_T)(numlit-1);                      \
+      memcpy(out+o,in+litstart,numlit);                 \
+      o+=numlit;                                        \
+      numlit=0;                                         \
+    }                                                   \
+  } while (0)
+
+  while (i<len) {
+    SIZE_T run=1;
+    while (i+run<len && run<MAXRUN && in[i+run]==in[i]) {
+      run++;
+    }
+    if (run>=MINRUN) {
+      FLUSHLITERALS;
+      if (o+2>outcap) { return 0; }
+      out[o++]=(BYTE_T)(0x80 | (run-MINRUN));
+      out[o++]=in[i];
+      i+=run;
+    } else {
+      if (numlit==0) {
+	litstart=i;
+      }
+      numlit++;
+      i++;
+      if (numlit==MAXLITERAL) {
+	FLUSHLITERALS;
+      }
+    }
+  }
+  FLUSHLITERALS;
+
+#undef FLUSHLITERALS
+
+  return o;
+}
+
+
+ERROR_T DecompressBlock(const BYTE_T *in, const SIZE_T inlen, BYTE_T *out, const SIZE_T outlen)
+{
+  SIZE_T i=0;
+  SIZE_T o=0;
+
+  while (i<inlen) {
+    BYTE_T c=in[i++];
+    if (c<0x80) {
+      SIZE_T n=(SIZE_T)c+1;
+      if (i+n>inlen || o+n>outlen) {
+	return ERROR_INSANE;
+      }
+      memcpy(out+o,in+i,n);
+      i+=n;
+      o+=n;
+    } else {
+      SIZE_T n=(SIZE_T)(c&0x7f)+MINRUN;
+      if (i>=inlen || o+n>outlen) {
+	return ERROR_INSANE;
+      }
+      memset(out+o,in[i++],n);
+      o+=n;
+    }
+  }
+
+  return o==outlen ? ERROR_NOERROR : ERROR_INSANE;
+}
@@ -0,0 +1,27 @@
+#ifndef _compress
+#define _compress
+
+#include "global.h"
+
+// Byte-oriented run-length codec (PackBits style) for disk blocks
+//
+// The stream is a sequence of runs, each introduced by a control byte c:
+//
+//   c <  0x80   c+1 literal bytes follow (1..128)
+//   c >= 0x80   the next byte is repeated (c&0x7f)+3 times (3..130)
+//
+// This is aimed at what btree blocks actually look like: a header,
+// some packed entries, and a long tail of zero or stale-but-zeroed
+// slots.  It costs almost nothing on incompressible data because
+// the caller simply stores such blocks raw.
+
+// Compress len bytes from in into out, which has room for outcap bytes.
+// Returns the compressed length, or zero if the result would not fit
+// in outcap bytes (ie, the block is not worth compressing).
+SIZE_T CompressBlock(const BYTE_T *in, const SIZE_T len, BYTE_T *out, const SIZE_T outcap);
+
+// Expand inlen bytes of compressed data into exactly outlen bytes at out
+// returns ERROR_NOERROR or ERROR_INSANE if the stream is malformed
+ERROR_T DecompressBlock(const BYTE_T *in, const SIZE_T inlen, BYTE_T *out, const SIZE_T outlen);
+
+#endif
@@ -0,0 +1,116 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_X86_CRC32C 1
+#else
+#define HAVE_X86_CRC32C 0
+#endif
+
+#include "crc32c.h"
+
+// Reflected form of the Castagnoli polynomial 0x1EDC6F41
+#define CRC32C_POLY 0x82F63B78
+
+static CRC_T crctable[8][256];
+static bool  crctableready=false;
+
+
+static void BuildTables()
+{
+  for (unsigned i=0;i<256;i++) {
+    CRC_T c=i;
+    for (unsigned j=0;j<8;j++) {
+      c = (c&1) ? (c>>1)^CRC32C_POLY : (c>>1);
+    }
+    crctable[0][i]=c;
+  }
+  for (unsigned i=0;i<256;i++) {
+    for (unsigned k=1;k<8;k++) {
+      crctable[k][i]=(crctable[k-1][i]>>8) ^ crctable[0][crctable[k-1][i]&0xff];
+    }
+  }
+  crctableready=true;
+}
+
+
+static CRC_T SoftwareCrc32c(CRC_T crc, const BYTE_T *buf, SIZE_T len)
+{
+  if (!crctableready) {
+    BuildTables();
+  }
+
+  // Slicing-by-8: consume eight bytes per step
+  while (len>=8) {
+    unsigned int lo, hi;
+    memcpy(&lo,buf,4);
+    memcpy(&hi,buf+4,4);
+    lo^=crc;
+    crc = crctable[7][lo&0xff] ^ crctable[6][(lo>>8)&0xff] ^
+          crctable[5][(lo>>16)&0xff] ^ crctable[4][lo>>24] ^
+          crctable[3][hi&0xff] ^ crctable[2][(hi>>8)&0xff] ^
+          crctable[1][(hi>>16)&0xff] ^ crctable[0][hi>>24];
+    buf+=8;
+    len-=8;
+  }
+  while (len>0) {
+    crc = (crc>>8) ^ crctable[0][(crc^*buf)&0xff];
+    buf++;
+    len--;
+  }
+  return crc;
+}
+
+
+#if HAVE_X86_CRC32C
+__attribute__((target("sse4.2")))
+static CRC_T HardwareCrc32c(CRC_T crc, const BYTE_T *buf, SIZE_T len)
+{
+#if defined(__x86_64__)
+  unsigned long long c=crc;
+  while (len>=8) {
+    unsigned long long v;
+    memcpy(&v,buf,8);
+    c=_mm_crc32_u64(c,v);
+    buf+=8;
+    len-=8;
+  }
+  crc=(CRC_T)c;
+#endif
+  while (len>=4) {
+    unsigned int v;
+    memcpy(&v,buf,4);
+    crc=_mm_crc32_u32(crc,v);
+    buf+=4;
+    len-=4;
+  }
+  while (len>0) {
+    crc=_mm_crc32_u8(crc,*buf);
+    buf++;
+    len--;
+  }
+  return crc;
+}
+#endif
+
+
+typedef CRC_T (*CrcFunc)(CRC_T, const BYTE_T *, SIZE_T);
+
+static CrcFunc SelectCrc32c()
+{
+#if HAVE_X86_CRC32C
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return HardwareCrc32c;
+  }
+#endif
+  return SoftwareCrc32c;
+}
+
+
+CRC_T Crc32c(const BYTE_T *buf, const SIZE_T len)
+{
+  static CrcFunc impl=SelectCrc32c();
+
+  return ~impl(~(CRC_T)0,buf,len);
+}
@@ -0,0 +1,15 @@
+#ifndef _crc32c
+#define _crc32c
+
+#include "global.h"
+
+typedef unsigned int CRC_T;
+
+// CRC32C (Castagnoli polynomial) of len bytes starting at buf
+//
+// Uses the SSE4.2 crc32 instruction when the CPU has it and
+// falls back to a table driven (slicing-by-8) software version
+// otherwise.  Both give identical results.
+CRC_T Crc32c(const BYTE_T *buf, const SIZE_T len);
+
+#endif
@@ -20,6 +20,9 @@ int main(int argc, char *argv[])
   remove((string(argv[1])+".data").c_str());
   remove((string(argv[1])+".bitmap").c_str());
   remove((string(argv[1])+".config").c_str());
+  remove((string(argv[1])+".checksum").c_str());
+  remove((string(argv[1])+".slots").c_str());
+  remove((string(argv[1])+".img").c_str());
 
   cerr << "Done.\n";
 
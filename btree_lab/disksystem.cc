@@ -1,21 +1,25 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <string.h>
 #include <stdio.h>
 
 #include <math.h>
 
+#include <algorithm>
+
 #include "disksystem.h"
+#include "compress.h"
 
 
-static SIZE_T mywrite(FILE *f, const SIZE_T off, const BYTE_T *buf, const int len)
+static SIZE_T mywrite(FILE *f, const unsigned long long off, const BYTE_T *buf, const int len)
 {
   SIZE_T left=len;
   SIZE_T sent;
 
-  fseek(f,off,SEEK_SET);
+  fseeko(f,off,SEEK_SET);
   while (left>0) {
     sent=fwrite(&(buf[len-left]),1,left,f);
     if (sent<0) {	
@@ -29,40 +33,22 @@ static SIZE_T mywrite(FILE *f, const SIZE_T off, const BYTE_T *buf, const int le
   return len-left;
 }
 
-static SIZE_T myread(FILE *f, const SIZE_T off, BYTE_T *buf, const int len, bool trunconeof=true)
+//
+// The data file always spans the whole disk (see SizeDataFile), so
+// running into end of file here is an error like any other short read
+//
+static SIZE_T myread(FILE *f, const unsigned long long off, BYTE_T *buf, const int len)
 {
   SIZE_T left=len;
   SIZE_T sent;
 
-  fseek(f,off,SEEK_SET);
+  fseeko(f,off,SEEK_SET);
   while (left>0) {
     sent=fread(&(buf[len-left]),1,left,f);
     if (sent<0) {	
       return 0;
     } else if (sent==0) {
-      // if we reached this point, the likely cause is that we
-      // are trying to read a block which has not been allocated yet
-      // Hence, we will try to ftruncate to this size and then retry the
-      // read.  However, we don't want to loop forever doing this,
-      // hence the trunconeof parameter
-      if (!feof(f)) { 
-	// OK, the end of file is not the problem
-	break;
-      } else {
-	// EOF case... should we truncate and try again?
-	if (!trunconeof) { 
-	  break;
-	} else {
-	  // yes!
-	  if (ftruncate(fileno(f),off+len)) { 
-	    // uh oh, something weird is going on
-	    break;
-	  } else {
-	    // OK, now retry, but don't truncate a second time
-	    return myread(f,off,buf,len,false);
-	  }
-	}
-      }
+      break;
     } else {
       left-=sent;
     }
@@ -70,6 +56,42 @@ static SIZE_T myread(FILE *f, const SIZE_T off, BYTE_T *buf, const int len, bool
   return len-left;
 }
 
+// Make sure the file is at least len bytes long.  With prealloc, the
+// space is reserved too, otherwise the extension is a hole.
+static ERROR_T myextend(FILE *f, const unsigned long long len, const bool prealloc)
+{
+  struct stat s;
+
+  fflush(f);
+  if (fstat(fileno(f),&s)) { 
+    return ERROR_NOFILE;
+  }
+  if (prealloc) { 
+    if (posix_fallocate(fileno(f),0,len)) { 
+      return ERROR_NOSPACE;
+    }
+  } else if ((unsigned long long)s.st_size<len) { 
+    if (ftruncate(fileno(f),len)) { 
+      return ERROR_NOSPACE;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+// Give the space behind [off,off+len) back to the filesystem.  The
+// range reads back as zeros afterwards.  Returns false if the
+// filesystem cannot do it, in which case the range is untouched.
+static bool mypunch(FILE *f, const unsigned long long off, const unsigned long long len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  // pending buffered writes must not land after the punch
+  fflush(f);
+  return fallocate(fileno(f),FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,off,len)==0;
+#else
+  return false;
+#endif
+}
+
 
 DiskSystem::DiskSystem(const string &filestem,
 		       const bool   create,
@@ -81,11 +103,25 @@ DiskSystem::DiskSystem(const string &filestem,
 		       const SIZE_T tracks,
 		       const double avgseek,
 		       const double trackseek,
-		       const double rotlat) :
+		       const double rotlat,
+		       const unsigned flgs) :
   bitmap(0),
+  bitmapdirty(0),
   datafilefd(0),
   configfilefd(0),
   bitmapfilefd(0),
+  checksums(0),
+  checksumfilefd(0),
+  slots(0),
+  slotfilefd(0),
+  fragmap(0),
+  fragsize(0),
+  numfrags(0),
+  fragrover(0),
+  imagefd(0),
+  bitmapbase(0),
+  checksumbase(0),
+  slotbase(0),
   diskfilestem(filestem), 
   offset(offset),
   numblocks(blcks),
@@ -95,26 +131,55 @@ DiskSystem::DiskSystem(const string &filestem,
   numtracks(tracks),
   last_track(0),
   last_sector(0),
+  flags(flgs),
   averageseeklatency(avgseek),
   trackseeklatency(trackseek),
   rotationallatency(rotlat)
 {
   if (create) { 
     // Only in this case are the parameters used:
-    InitFromInMemoryConfig();
+    if (flags & DISKSYSTEM_IMAGE) { 
+      InitImageFromInMemoryConfig();
+    } else {
+      InitFromInMemoryConfig();
+    }
   } else {
-    InitFromConfigFile();
+    // An image, if there is one, takes precedence
+    ERROR_T rc=InitFromImageFile();
+    if (rc==ERROR_NOFILE) { 
+      rc=InitFromConfigFile();
+    }
+    if (rc) { 
+      AbandonFiles();
+    }
   }
 }
 
 DiskSystem::~DiskSystem()
 {
-  WriteConfig();
-  WriteBitMap();
-  fclose(configfilefd);
-  fclose(bitmapfilefd);
-  fclose(datafilefd);
+  if (imagefd) { 
+    // geometry in the header never changes after creation
+    FlushBitMap();
+    fclose(imagefd);
+  } else {
+    // Files that never opened (no such disk) are skipped
+    if (configfilefd) { 
+      WriteConfig();
+      fclose(configfilefd);
+    }
+    if (bitmapfilefd) { 
+      FlushBitMap();
+      fclose(bitmapfilefd);
+    }
+    if (datafilefd) { fclose(datafilefd); }
+    if (checksumfilefd) { fclose(checksumfilefd); }
+    if (slotfilefd) { fclose(slotfilefd); }
+  }
   delete [] bitmap;
+  delete [] bitmapdirty;
+  delete [] checksums;
+  delete [] slots;
+  delete [] fragmap;
 }
 
 ERROR_T DiskSystem::SanityCheckConfig()
@@ -136,7 +201,7 @@ ERROR_T DiskSystem::WriteConfig()
 {
   ftruncate(fileno(configfilefd),0);
   rewind(configfilefd);
-  fprintf(configfilefd,"# disksystem config file version 0.9\n");
+  fprintf(configfilefd,"# disksystem config file version 1.0\n");
   fprintf(configfilefd,"# filestem\n");
   fprintf(configfilefd,"%s\n",diskfilestem.c_str());
   fprintf(configfilefd,"# offset\n");
@@ -157,6 +222,8 @@ ERROR_T DiskSystem::WriteConfig()
   fprintf(configfilefd,"%lf\n",trackseeklatency);
   fprintf(configfilefd,"# rotationalatency\n");
   fprintf(configfilefd,"%lf\n",rotationallatency);
+  fprintf(configfilefd,"# flags\n");
+  fprintf(configfilefd,"%u\n",flags);
   fflush(configfilefd);
 
   return ERROR_NOERROR;
@@ -168,7 +235,9 @@ ERROR_T DiskSystem::ReadConfig()
 {
   char buf[80];
 
-#define GETNEXTVAL do { fgets(buf,80,configfilefd); } while (buf[0]=='#')  
+// Version 0.9 config files end after rotationallatency, so running
+// off the end leaves buf empty and the field keeps its default
+#define GETNEXTVAL do { if (!fgets(buf,80,configfilefd)) { buf[0]=0; break; } } while (buf[0]=='#')  
 #define PARSEUNSIGNED(x) do { sscanf(buf,"%u",x); } while (0)
 #define PARSEDOUBLE(x) do { sscanf(buf,"%lf",x); } while (0)
 
@@ -196,35 +265,110 @@ ERROR_T DiskSystem::ReadConfig()
   PARSEDOUBLE(&trackseeklatency);
   GETNEXTVAL;
   PARSEDOUBLE(&rotationallatency);
+  flags=0;
+  GETNEXTVAL;
+  PARSEUNSIGNED(&flags);
 
   return ERROR_NOERROR;
 }
 
 
+SIZE_T DiskSystem::NumBitMapBytes() const
+{
+  return numblocks / 8 + (numblocks%8 != 0); 
+}
+
+SIZE_T DiskSystem::NumBitMapPages() const
+{
+  return (NumBitMapBytes()+DISKSYSTEM_BITMAP_PAGE-1)/DISKSYSTEM_BITMAP_PAGE;
+}
+
+void DiskSystem::AllocateBitMap()
+{
+  if (bitmap) { delete [] bitmap; }
+  if (bitmapdirty) { delete [] bitmapdirty; }
+
+  bitmap = new BYTE_T [NumBitMapBytes()];
+  bitmapdirty = new BYTE_T [NumBitMapPages()];
+
+  memset(bitmapdirty,0,NumBitMapPages());
+}
+
+// Whole bitmap, used only when the disk is created
 ERROR_T DiskSystem::WriteBitMap()
 {
-  rewind(bitmapfilefd);
-  
-  SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
+  SIZE_T numbitmapbytes = NumBitMapBytes();
 
-  if (mywrite(bitmapfilefd,0,bitmap,numbitmapbytes)!=numbitmapbytes) { 
+  if (mywrite(bitmapfilefd,bitmapbase,bitmap,numbitmapbytes)!=numbitmapbytes) { 
     cerr << "Can't write bitmap file\n";
     return ERROR_IMPLBUG;
   }
+  memset(bitmapdirty,0,NumBitMapPages());
+  fflush(bitmapfilefd);
+  fdatasync(fileno(bitmapfilefd));
   return ERROR_NOERROR;
 }
 
-ERROR_T DiskSystem::ReadBitMap()
+//
+// Write back only the bitmap pages changed since the last flush,
+// coalescing adjacent dirty pages into one write.  The pages are
+// synced before they are marked clean, so after FlushBitMap returns
+// the file matches memory even if we crash right afterwards.  Each
+// page is sector sized, so a crash during the flush leaves every
+// page either old or new.
+//
+ERROR_T DiskSystem::FlushBitMap()
 {
-  rewind(bitmapfilefd);
-  
-  SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
+  SIZE_T numpages = NumBitMapPages();
+  SIZE_T numbitmapbytes = NumBitMapBytes();
+  bool wrote=false;
 
-  if (bitmap) { delete [] bitmap; } ;
+  if (bitmapdirty==0) { 
+    // The disk never loaded
+    return ERROR_NOERROR;
+  }
 
-  bitmap = new BYTE_T [numbitmapbytes];
+  for (SIZE_T p=0; p<numpages; ) { 
+    if (!bitmapdirty[p]) { 
+      p++;
+      continue;
+    }
+    SIZE_T q=p;
+    while (q<numpages && bitmapdirty[q]) { 
+      q++;
+    }
+    SIZE_T start=p*DISKSYSTEM_BITMAP_PAGE;
+    SIZE_T end=q*DISKSYSTEM_BITMAP_PAGE;
+    if (end>numbitmapbytes) { 
+      end=numbitmapbytes;
+    }
+    if (mywrite(bitmapfilefd,bitmapbase+start,bitmap+start,end-start)!=end-start) { 
+      cerr << "Can't write bitmap file\n";
+      return ERROR_IMPLBUG;
+    }
+    wrote=true;
+    p=q;
+  }
 
-  if (myread(bitmapfilefd,0,bitmap,numbitmapbytes,false)!=numbitmapbytes) { 
+  if (wrote) { 
+    fflush(bitmapfilefd);
+    if (fdatasync(fileno(bitmapfilefd))) { 
+      cerr << "Can't sync bitmap file\n";
+      return ERROR_IMPLBUG;
+    }
+    memset(bitmapdirty,0,numpages);
+  }
+
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::ReadBitMap()
+{
+  SIZE_T numbitmapbytes = NumBitMapBytes();
+
+  AllocateBitMap();
+
+  if (myread(bitmapfilefd,bitmapbase,bitmap,numbitmapbytes)!=numbitmapbytes) { 
     cerr << "Can't read bitmap file\n";
     return ERROR_IMPLBUG;
   }
@@ -233,6 +377,316 @@ ERROR_T DiskSystem::ReadBitMap()
 
 
 
+ERROR_T DiskSystem::WriteChecksums()
+{
+  if (mywrite(checksumfilefd,checksumbase,(BYTE_T*)checksums,numblocks*sizeof(CRC_T))!=numblocks*sizeof(CRC_T)) { 
+    cerr << "Can't write checksum file\n";
+    return ERROR_IMPLBUG;
+  }
+  fflush(checksumfilefd);
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::ReadChecksums()
+{
+  if (checksums) { delete [] checksums; }
+
+  checksums = new CRC_T [numblocks];
+
+  if (myread(checksumfilefd,checksumbase,(BYTE_T*)checksums,numblocks*sizeof(CRC_T))!=numblocks*sizeof(CRC_T)) { 
+    cerr << "Can't read checksum file\n";
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+//
+// The in-memory table is the authority, but each entry is also
+// written through (buffered) so that the checksum file follows
+// the data file as closely as the data file follows the cache
+//
+ERROR_T DiskSystem::StampChecksum(const SIZE_T block, const BYTE_T *data)
+{
+  checksums[block]=Crc32c(data,blocksize);
+
+  if (mywrite(checksumfilefd,checksumbase+(unsigned long long)block*sizeof(CRC_T),(BYTE_T*)&(checksums[block]),sizeof(CRC_T))!=sizeof(CRC_T)) { 
+    cerr << "DiskSystem::StampChecksum: can't write checksum of block "<<block<<endl;
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::VerifyChecksum(const SIZE_T block, const BYTE_T *data) const
+{
+  CRC_T crc=Crc32c(data,blocksize);
+
+  if (crc!=checksums[block]) { 
+    cerr << "DiskSystem::VerifyChecksum: block "<<block<<" is corrupt (stored crc "
+	 << hex << checksums[block] << ", computed crc " << crc << dec << ")"<<endl;
+    return ERROR_CHECKSUM;
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Single file images
+//
+// filestem.img holds, in order, a DiskImageHeader, the allocation
+// bitmap, the checksums (if any), the slot table (if compressed), and
+// then the data region starting on a block boundary.  Everything
+// before the data region is read with one read when the image is
+// opened, and the bitmap, checksum, and slot file handles all become
+// the image handle with the corresponding section as their base.
+//
+
+ERROR_T DiskSystem::LayoutImage(DiskImageHeader &h) const
+{
+  memset(&h,0,sizeof(h));
+  memcpy(h.magic,DISKSYSTEM_IMAGE_MAGIC,sizeof(h.magic));
+  h.version=DISKSYSTEM_IMAGE_VERSION;
+  h.numblocks=numblocks;
+  h.blocksize=blocksize;
+  h.numheads=numheads;
+  h.blockspertrack=blockspertrack;
+  h.numtracks=numtracks;
+  h.flags=flags;
+  h.averageseeklatency=averageseeklatency;
+  h.trackseeklatency=trackseeklatency;
+  h.rotationallatency=rotationallatency;
+
+  unsigned long long pos=sizeof(h);
+  h.bitmapoffset=pos;
+  pos+=NumBitMapBytes();
+  h.checksumoffset=pos;
+  if (flags & DISKSYSTEM_CHECKSUM) { 
+    pos+=(unsigned long long)numblocks*sizeof(CRC_T);
+  }
+  h.slotoffset=pos;
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    pos+=(unsigned long long)numblocks*sizeof(CompressedSlot);
+  }
+  h.dataoffset=((pos+blocksize-1)/blocksize)*blocksize;
+
+  return ERROR_NOERROR;
+}
+
+bool DiskSystem::ImageSectionFits(const DiskImageHeader &h,
+				  const unsigned long long sectionoffset,
+				  const unsigned long long sectionbytes)
+{
+  return sectionoffset>=sizeof(h) && 
+         sectionoffset<=h.dataoffset && 
+         sectionbytes<=h.dataoffset-sectionoffset;
+}
+
+void DiskSystem::UseImageSections(const DiskImageHeader &h)
+{
+  datafilefd=bitmapfilefd=checksumfilefd=slotfilefd=imagefd;
+  configfilefd=0;
+  bitmapbase=h.bitmapoffset;
+  checksumbase=h.checksumoffset;
+  slotbase=h.slotoffset;
+  offset=h.dataoffset;
+}
+
+ERROR_T DiskSystem::InitImageFromInMemoryConfig()
+{
+  string imagename = diskfilestem + ".img";
+  struct stat s;
+  DiskImageHeader h;
+  ERROR_T rc;
+
+  rc=SanityCheckConfig();
+
+  if (rc) { 
+    return rc;
+  }
+
+  if (stat(imagename.c_str(),&s)!=-1) { 
+    cerr << "Image file exists for this name!\n";
+    return ERROR_BADCONFIG;
+  }
+
+  if ((imagefd = fopen(imagename.c_str(),"w+"))==0) { 
+    return ERROR_NOFILE;
+  }
+
+  LayoutImage(h);
+  UseImageSections(h);
+
+  if (mywrite(imagefd,0,(BYTE_T*)&h,sizeof(h))!=sizeof(h)) { 
+    cerr << "Can't write image header\n";
+    return ERROR_IMPLBUG;
+  }
+
+  AllocateBitMap();
+  memset(bitmap,0,NumBitMapBytes());
+
+  rc = WriteBitMap();
+
+  if (rc) { 
+    return rc;
+  }
+
+  if (flags & DISKSYSTEM_CHECKSUM) { 
+    Block zero(blocksize);
+    memset(zero.data,0,blocksize);
+    CRC_T zerocrc=Crc32c(zero.data,blocksize);
+
+    checksums = new CRC_T [numblocks];
+    for (SIZE_T i=0;i<numblocks;i++) { 
+      checksums[i]=zerocrc;
+    }
+
+    rc = WriteChecksums();
+
+    if (rc) { 
+      return rc;
+    }
+  }
+
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    slots = new CompressedSlot [numblocks];
+    memset(slots,0,numblocks*sizeof(CompressedSlot));
+
+    rc = WriteSlots();
+
+    if (rc) { 
+      return rc;
+    }
+
+    InitCompression();
+    RebuildFragmentMap();
+  }
+
+  rc = myextend(imagefd,offset+DataRegionBytes(),flags & DISKSYSTEM_PREALLOC);
+
+  if (rc) { 
+    cerr << "Can't size image file\n";
+    return rc;
+  }
+
+  fflush(imagefd);
+
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::InitFromImageFile()
+{
+  string imagename = diskfilestem + ".img";
+
+  if ((imagefd = fopen(imagename.c_str(),"r+"))==0) { 
+    return ERROR_NOFILE;
+  }
+
+  return ReadImageFile();
+}
+
+//
+// The disk didn't load.  Leave none behind, as when there are no files
+// at all, so that nothing writes back into them or trusts what was
+// read of the geometry.
+//
+void DiskSystem::AbandonFiles()
+{
+  if (imagefd) { fclose(imagefd); imagefd=0; }
+  if (configfilefd) { fclose(configfilefd); configfilefd=0; }
+  if (bitmapfilefd) { fclose(bitmapfilefd); bitmapfilefd=0; }
+  if (datafilefd) { fclose(datafilefd); datafilefd=0; }
+  if (checksumfilefd) { fclose(checksumfilefd); checksumfilefd=0; }
+  if (slotfilefd) { fclose(slotfilefd); slotfilefd=0; }
+  numblocks=0;
+}
+
+ERROR_T DiskSystem::ReadImageFile()
+{
+  DiskImageHeader h;
+
+  // Everything in front of the data region comes in with one read.
+  // It is at most a few bytes per block, and the header tells us how
+  // much that is, so read a generous first guess and only go back
+  // for more on very large disks.
+  vector<BYTE_T> meta(DISKSYSTEM_IMAGE_FIRSTREAD);
+  SIZE_T got=myread(imagefd,0,&(meta[0]),meta.size());
+
+  if (got<sizeof(h)) { 
+    cerr << "Image file is too short\n";
+    return ERROR_BADCONFIG;
+  }
+
+  memcpy(&h,&(meta[0]),sizeof(h));
+
+  if (memcmp(h.magic,DISKSYSTEM_IMAGE_MAGIC,sizeof(h.magic)) || h.version!=DISKSYSTEM_IMAGE_VERSION) { 
+    cerr << "Not a disk image (or an unsupported version)\n";
+    return ERROR_BADCONFIG;
+  }
+
+  numblocks=h.numblocks;
+  blocksize=h.blocksize;
+  numheads=h.numheads;
+  blockspertrack=h.blockspertrack;
+  numtracks=h.numtracks;
+  flags=h.flags;
+  averageseeklatency=h.averageseeklatency;
+  trackseeklatency=h.trackseeklatency;
+  rotationallatency=h.rotationallatency;
+
+  ERROR_T rc=SanityCheckConfig();
+
+  if (rc) { 
+    return rc;
+  }
+
+  // The sections have to lie between the header and the data, which
+  // starts on a block boundary no later than this geometry needs
+  DiskImageHeader layout;
+  LayoutImage(layout);
+
+  if (blocksize==0 || h.dataoffset%blocksize!=0 || 
+      h.dataoffset<sizeof(h) || h.dataoffset>layout.dataoffset ||
+      !ImageSectionFits(h,h.bitmapoffset,NumBitMapBytes()) ||
+      ((flags & DISKSYSTEM_CHECKSUM) && 
+       !ImageSectionFits(h,h.checksumoffset,(unsigned long long)numblocks*sizeof(CRC_T))) ||
+      ((flags & DISKSYSTEM_COMPRESS) && 
+       !ImageSectionFits(h,h.slotoffset,(unsigned long long)numblocks*sizeof(CompressedSlot)))) { 
+    cerr << "Image header is corrupt\n";
+    return ERROR_BADCONFIG;
+  }
+
+  if (h.dataoffset>got) { 
+    meta.resize(h.dataoffset);
+    if (myread(imagefd,got,&(meta[got]),h.dataoffset-got)!=h.dataoffset-got) { 
+      cerr << "Can't read image metadata\n";
+      return ERROR_BADCONFIG;
+    }
+  }
+
+  UseImageSections(h);
+
+  AllocateBitMap();
+  memcpy(bitmap,&(meta[h.bitmapoffset]),NumBitMapBytes());
+
+  if (flags & DISKSYSTEM_CHECKSUM) { 
+    checksums = new CRC_T [numblocks];
+    memcpy(checksums,&(meta[h.checksumoffset]),numblocks*sizeof(CRC_T));
+  }
+
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    slots = new CompressedSlot [numblocks];
+    memcpy(slots,&(meta[h.slotoffset]),numblocks*sizeof(CompressedSlot));
+    InitCompression();
+    rc=CheckSlots();
+    if (rc) { 
+      return rc;
+    }
+    RebuildFragmentMap();
+  }
+
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T DiskSystem::InitFromConfigFile()
 {
   string configname = diskfilestem + ".config";
@@ -263,6 +717,13 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return ERROR_NOFILE;
   }
 
+  // Data files made before the data file was sized at creation
+  // may be short; extend them once here
+  rc = myextend(datafilefd,offset+DataRegionBytes(),false);
+
+  if (rc) { 
+    return rc;
+  }
 
   if (bitmapfilefd) { fclose(bitmapfilefd);}
 
@@ -276,6 +737,47 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return rc;
   }
 
+  if (flags & DISKSYSTEM_CHECKSUM) { 
+    string checksumname = diskfilestem + ".checksum";
+
+    if (checksumfilefd) { fclose(checksumfilefd);}
+
+    if ((checksumfilefd = fopen(checksumname.c_str(),"r+"))==0) { 
+      return ERROR_NOFILE;
+    }
+
+    rc = ReadChecksums();
+
+    if (rc) { 
+      return rc;
+    }
+  }
+
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    string slotname = diskfilestem + ".slots";
+
+    if (slotfilefd) { fclose(slotfilefd);}
+
+    if ((slotfilefd = fopen(slotname.c_str(),"r+"))==0) { 
+      return ERROR_NOFILE;
+    }
+
+    rc = ReadSlots();
+
+    if (rc) { 
+      return rc;
+    }
+
+    InitCompression();
+    rc = CheckSlots();
+
+    if (rc) { 
+      return rc;
+    }
+
+    RebuildFragmentMap();
+  }
+
   return ERROR_NOERROR;
 }
 
@@ -324,11 +826,9 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
 
   // allocate in-memory bitmap
 
-  SIZE_T numbitmapbytes = numblocks / 8 + (numblocks%8 != 0); 
-  
-  bitmap = new BYTE_T [numbitmapbytes];
+  AllocateBitMap();
 
-  memset(bitmap,0,numbitmapbytes);
+  memset(bitmap,0,NumBitMapBytes());
 
   // create the bitmap file and write out the bitmap
 
@@ -350,7 +850,9 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
 
   if (datafilefd) { fclose(datafilefd);}
 
-  if (stat(dataname.c_str(),&s)!=-1) { 
+  bool reused = stat(dataname.c_str(),&s)!=-1;
+
+  if (reused) { 
     // reuse existing datafile
     if ((datafilefd = fopen(dataname.c_str(),"r+"))==0) { 
       return ERROR_NOFILE;
@@ -362,6 +864,73 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
     }
   }
 
+  rc = myextend(datafilefd,offset+DataRegionBytes(),flags & DISKSYSTEM_PREALLOC);
+
+  if (rc) { 
+    cerr << "Can't size data file\n";
+    return rc;
+  }
+
+  if (flags & DISKSYSTEM_CHECKSUM) { 
+    string checksumname = diskfilestem + ".checksum";
+
+    // Stamp every block with the checksum of what it holds now.  For a
+    // fresh (or compressed, hence empty) data file that is all zeros,
+    // so one computation will do.
+    checksums = new CRC_T [numblocks];
+
+    Block b(blocksize);
+    memset(b.data,0,blocksize);
+    CRC_T zerocrc=Crc32c(b.data,blocksize);
+
+    for (SIZE_T i=0;i<numblocks;i++) { 
+      if (reused && !(flags & DISKSYSTEM_COMPRESS)) { 
+	if (myread(datafilefd,offset+(unsigned long long)i*blocksize,b.data,blocksize)!=blocksize) { 
+	  return ERROR_IMPLBUG;
+	}
+	checksums[i]=Crc32c(b.data,blocksize);
+      } else {
+	checksums[i]=zerocrc;
+      }
+    }
+
+    if (checksumfilefd) { fclose(checksumfilefd); }
+
+    if ((checksumfilefd = fopen(checksumname.c_str(),"w+"))==0) { 
+      return ERROR_NOFILE;
+    }
+
+    rc = WriteChecksums();
+
+    if (rc) { 
+      return rc;
+    }
+  }
+
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    string slotname = diskfilestem + ".slots";
+
+    // Nothing is stored yet; whatever a reused data file holds
+    // is not in compressed form, so every block starts out empty
+    slots = new CompressedSlot [numblocks];
+    memset(slots,0,numblocks*sizeof(CompressedSlot));
+
+    if (slotfilefd) { fclose(slotfilefd); }
+
+    if ((slotfilefd = fopen(slotname.c_str(),"w+"))==0) { 
+      return ERROR_NOFILE;
+    }
+
+    rc = WriteSlots();
+
+    if (rc) { 
+      return rc;
+    }
+
+    InitCompression();
+    RebuildFragmentMap();
+  }
+
   return ERROR_NOERROR;
 }
 
@@ -375,12 +944,25 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
 //
 double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock) 
 {
+  return ModelAccessBytes((unsigned long long)offblock*blocksize,
+			  (unsigned long long)numblock*blocksize);
+}
+
+//
+// Same model, but for a transfer that need not be a whole number
+// of blocks.  Positioning is still to the block (sector) containing
+// the first byte, but only the bytes moved are charged rotation time.
+//
+double DiskSystem::ModelAccessBytes(const unsigned long long offbyte, const unsigned long long numbyte) 
+{
+  SIZE_T offblock = offbyte / blocksize;
+  SIZE_T lastblock = (offbyte+numbyte-1) / blocksize;
 
   SIZE_T req_trackstart = (offblock) / (numheads*blockspertrack);
   SIZE_T req_sectorstart=  (offblock) % (numheads*blockspertrack);
 
-  SIZE_T req_trackend = (offblock+numblock-1) / (numheads*blockspertrack);
-  SIZE_T req_sectorend=  (offblock+numblock-1) % (numheads*blockspertrack);
+  SIZE_T req_trackend = (lastblock) / (numheads*blockspertrack);
+  SIZE_T req_sectorend=  (lastblock) % (numheads*blockspertrack);
 
   SIZE_T trackhop = (SIZE_T) fabs((double)req_trackstart-(double)last_track);
   double trackhopfrac = (double)trackhop/(double)numtracks;
@@ -404,7 +986,7 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   double timeintrackbytrackhops = numtrackbytrackhops*trackseeklatency;
 
   // The total number of sectors read
-  double timeinreadsectors = rotationallatency*((double)numblock/(double)blockspertrack);
+  double timeinreadsectors = rotationallatency*(((double)numbyte/(double)blocksize)/(double)blockspertrack);
 
   last_track=req_trackend;
   last_sector=req_sectorend;
@@ -425,6 +1007,10 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
     return ERROR_NOSPACE;
   }
 
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    return ReadCompressed(inoffblock,numblock,blocks,reqtime);
+  }
+
   reqtime=ModelAccess(inoffblock,numblock);
 
   for (SIZE_T i=0;i<numblock;i++) { 
@@ -434,10 +1020,16 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
 	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
       }
     }
-    if (myread(datafilefd,offset+(inoffblock+i)*blocksize,b.data,blocksize,true)!=blocksize) { 
+    if (myread(datafilefd,offset+(unsigned long long)(inoffblock+i)*blocksize,b.data,blocksize)!=blocksize) { 
       cerr << "DiskSystem::Read: myread has failed"<<endl;
       return ERROR_IMPLBUG;
     }
+    if (flags & DISKSYSTEM_CHECKSUM) { 
+      ERROR_T rc=VerifyChecksum(inoffblock+i,b.data);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+    }
     blocks.push_back(b);
   }
 
@@ -456,6 +1048,10 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
     return ERROR_NOSPACE;
   }
 
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    return WriteCompressed(inoffblock,numblock,blocks,reqtime);
+  }
+
   reqtime=ModelAccess(inoffblock,numblock);
 
   for (SIZE_T i=0;i<numblock;i++) { 
@@ -464,10 +1060,312 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
 	cerr <<"DiskSystem::Write: writing unallocated block "<<(i+inoffblock)<<endl;
       }
     }
-    if (mywrite(datafilefd,offset+(inoffblock+i)*blocksize,blocks[i].data,blocksize)!=blocksize) {  
+    if (mywrite(datafilefd,offset+(unsigned long long)(inoffblock+i)*blocksize,blocks[i].data,blocksize)!=blocksize) {  
+      cerr << "DiskSystem::Write: mywrite has failed"<<endl;
+      return ERROR_IMPLBUG;
+    }
+    if (flags & DISKSYSTEM_CHECKSUM) { 
+      ERROR_T rc=StampChecksum(inoffblock+i,blocks[i].data);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+//
+// Compressed storage
+//
+// Logical block b lives in slots[b].length bytes starting at fragment
+// slots[b].fragment of the data file.  A length of zero means the block
+// has never been written (it reads as zeros), and a length of blocksize
+// means it did not compress and is stored raw.  The data region has
+// room for every block raw, so space can only run out through
+// fragmentation, which CompactFragments() repairs.
+//
+
+unsigned long long DiskSystem::DataRegionBytes() const
+{
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    SIZE_T fs=(blocksize+DISKSYSTEM_FRAGMENTS_PER_BLOCK-1)/DISKSYSTEM_FRAGMENTS_PER_BLOCK;
+    return (unsigned long long)numblocks*DISKSYSTEM_FRAGMENTS_PER_BLOCK*fs;
+  } else {
+    return (unsigned long long)numblocks*blocksize;
+  }
+}
+
+SIZE_T DiskSystem::FragmentsFor(const SIZE_T len) const
+{
+  return (len+fragsize-1)/fragsize;
+}
+
+//
+// The slot table comes from a file, so before anything indexes with
+// it, every slot must lie within the fragments and hold at most a
+// block, and no two slots may share a fragment.  fragmap is used to
+// spot overlaps.
+//
+ERROR_T DiskSystem::CheckSlots()
+{
+  memset(fragmap,0,numfrags);
+  for (SIZE_T b=0;b<numblocks;b++) { 
+    if (slots[b].length==0) { 
+      continue;
+    }
+    SIZE_T n=FragmentsFor(slots[b].length);
+    if (slots[b].length>blocksize || slots[b].fragment>=numfrags || n>numfrags-slots[b].fragment) { 
+      cerr << "Slot table entry for block "<<b<<" is out of range\n";
+      return ERROR_BADCONFIG;
+    }
+    for (SIZE_T f=slots[b].fragment;f<slots[b].fragment+n;f++) { 
+      if (fragmap[f]) { 
+	cerr << "Slot table entry for block "<<b<<" overlaps another\n";
+	return ERROR_BADCONFIG;
+      }
+      fragmap[f]=1;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+void DiskSystem::RebuildFragmentMap()
+{
+  memset(fragmap,0,numfrags);
+  for (SIZE_T b=0;b<numblocks;b++) { 
+    if (slots[b].length>0) { 
+      memset(fragmap+slots[b].fragment,1,FragmentsFor(slots[b].length));
+    }
+  }
+  fragrover=0;
+}
+
+// next-fit, so that a stream of rewrites lands roughly sequentially
+bool DiskSystem::FindFragments(const SIZE_T num, SIZE_T &start)
+{
+  SIZE_T scanned=0;
+  SIZE_T f=fragrover;
+  SIZE_T run=0;
+
+  while (scanned<numfrags+num) { 
+    if (f==numfrags) { 
+      f=0;
+      run=0;
+    }
+    if (fragmap[f]) { 
+      run=0;
+    } else {
+      run++;
+      if (run==num) { 
+	start=f+1-num;
+	fragrover=f+1;
+	return true;
+      }
+    }
+    f++;
+    scanned++;
+  }
+  return false;
+}
+
+// Slide every stored block down to the front of the data region
+ERROR_T DiskSystem::CompactFragments(double &reqtime)
+{
+  vector<pair<SIZE_T,SIZE_T> > order;  // (fragment, block)
+
+  for (SIZE_T b=0;b<numblocks;b++) { 
+    if (slots[b].length>0) { 
+      order.push_back(pair<SIZE_T,SIZE_T>(slots[b].fragment,b));
+    }
+  }
+  sort(order.begin(),order.end());
+
+  Block buf(blocksize);
+  SIZE_T next=0;
+
+  for (SIZE_T i=0;i<order.size();i++) { 
+    SIZE_T b=order[i].second;
+    if (slots[b].fragment!=next) { 
+      unsigned long long from=(unsigned long long)slots[b].fragment*fragsize;
+      unsigned long long to=(unsigned long long)next*fragsize;
+      if (myread(datafilefd,offset+from,buf.data,slots[b].length)!=slots[b].length) { 
+	return ERROR_IMPLBUG;
+      }
+      reqtime+=ModelAccessBytes(from,slots[b].length);
+      if (mywrite(datafilefd,offset+to,buf.data,slots[b].length)!=slots[b].length) { 
+	return ERROR_IMPLBUG;
+      }
+      reqtime+=ModelAccessBytes(to,slots[b].length);
+      slots[b].fragment=next;
+      ERROR_T rc=StoreSlot(b);
+      if (rc) { 
+	return rc;
+      }
+    }
+    next+=FragmentsFor(slots[b].length);
+  }
+
+  RebuildFragmentMap();
+  fragrover=next;
+
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::StoreSlot(const SIZE_T block)
+{
+  if (mywrite(slotfilefd,slotbase+(unsigned long long)block*sizeof(CompressedSlot),(BYTE_T*)&(slots[block]),sizeof(CompressedSlot))!=sizeof(CompressedSlot)) { 
+    cerr << "DiskSystem::StoreSlot: can't write slot of block "<<block<<endl;
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::WriteSlots()
+{
+  if (mywrite(slotfilefd,slotbase,(BYTE_T*)slots,numblocks*sizeof(CompressedSlot))!=numblocks*sizeof(CompressedSlot)) { 
+    cerr << "Can't write slot table file\n";
+    return ERROR_IMPLBUG;
+  }
+  fflush(slotfilefd);
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::ReadSlots()
+{
+  if (slots) { delete [] slots; }
+
+  slots = new CompressedSlot [numblocks];
+
+  if (myread(slotfilefd,slotbase,(BYTE_T*)slots,numblocks*sizeof(CompressedSlot))!=numblocks*sizeof(CompressedSlot)) { 
+    cerr << "Can't read slot table file\n";
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+void DiskSystem::InitCompression()
+{
+  fragsize = (blocksize+DISKSYSTEM_FRAGMENTS_PER_BLOCK-1)/DISKSYSTEM_FRAGMENTS_PER_BLOCK;
+  numfrags = numblocks*FragmentsFor(blocksize);
+  if (fragmap) { delete [] fragmap; }
+  fragmap = new BYTE_T [numfrags];
+}
+
+
+ERROR_T DiskSystem::ReadCompressed(const SIZE_T   inoffblock,
+				   const SIZE_T   numblock,
+				   vector<Block> &blocks,
+				   double        &reqtime)
+{
+  Block packed(blocksize);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    SIZE_T blk=inoffblock+i;
+    Block b(blocksize);
+    if (!IsBlockAllocated(blk)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::Read: reading unallocated block "<<blk<<endl;
+      }
+    }
+    const CompressedSlot &slot=slots[blk];
+    if (slot.length==0) { 
+      memset(b.data,0,blocksize);
+    } else {
+      unsigned long long pos=(unsigned long long)slot.fragment*fragsize;
+      reqtime+=ModelAccessBytes(pos,slot.length);
+      BYTE_T *dest = slot.length==blocksize ? b.data : packed.data;
+      if (myread(datafilefd,offset+pos,dest,slot.length)!=slot.length) { 
+	cerr << "DiskSystem::Read: myread has failed"<<endl;
+	return ERROR_IMPLBUG;
+      }
+      if (slot.length!=blocksize) { 
+	if (DecompressBlock(packed.data,slot.length,b.data,blocksize)!=ERROR_NOERROR) { 
+	  cerr << "DiskSystem::Read: block "<<blk<<" does not decompress"<<endl;
+	  return ERROR_INSANE;
+	}
+      }
+    }
+    if (flags & DISKSYSTEM_CHECKSUM) { 
+      ERROR_T rc=VerifyChecksum(blk,b.data);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+    }
+    blocks.push_back(b);
+  }
+
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::WriteCompressed(const SIZE_T   inoffblock,
+				    const SIZE_T   numblock,
+				    const vector<Block> &blocks,
+				    double        &reqtime)
+{
+  Block packed(blocksize);
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    SIZE_T blk=inoffblock+i;
+    if (!IsBlockAllocated(blk)) { 
+      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+	cerr <<"DiskSystem::Write: writing unallocated block "<<blk<<endl;
+      }
+    }
+
+    SIZE_T len=CompressBlock(blocks[i].data,blocksize,packed.data,blocksize-1);
+    const BYTE_T *src=packed.data;
+    if (len==0) { 
+      len=blocksize;
+      src=blocks[i].data;
+    }
+
+    CompressedSlot &slot=slots[blk];
+    SIZE_T need=FragmentsFor(len);
+    SIZE_T have=FragmentsFor(slot.length);
+
+    if (need<=have) { 
+      // shrink in place
+      memset(fragmap+slot.fragment+need,0,have-need);
+    } else {
+      if (have>0) { 
+	memset(fragmap+slot.fragment,0,have);
+      }
+      slot.length=0;
+      SIZE_T start;
+      if (!FindFragments(need,start)) { 
+	rc=CompactFragments(reqtime);
+	if (rc) { 
+	  return rc;
+	}
+	if (!FindFragments(need,start)) { 
+	  cerr << "DiskSystem::Write: no room for block "<<blk<<" even after compaction"<<endl;
+	  return ERROR_NOSPACE;
+	}
+      }
+      memset(fragmap+start,1,need);
+      slot.fragment=start;
+    }
+    slot.length=len;
+
+    unsigned long long pos=(unsigned long long)slot.fragment*fragsize;
+    reqtime+=ModelAccessBytes(pos,len);
+    if (mywrite(datafilefd,offset+pos,src,len)!=len) {  
       cerr << "DiskSystem::Write: mywrite has failed"<<endl;
       return ERROR_IMPLBUG;
     }
+    rc=StoreSlot(blk);
+    if (rc) { 
+      return rc;
+    }
+    if (flags & DISKSYSTEM_CHECKSUM) { 
+      rc=StampChecksum(blk,blocks[i].data);
+      if (rc!=ERROR_NOERROR) { 
+	return rc;
+      }
+    }
   }
 
   return ERROR_NOERROR;
@@ -515,11 +1413,39 @@ SIZE_T DiskSystem::GetNumBlocks() const
   return numblocks;
 }
 
+unsigned DiskSystem::GetFlags() const
+{
+  return flags;
+}
+
+SIZE_T DiskSystem::GetNumChecksumBytes() const
+{
+  return (flags & DISKSYSTEM_CHECKSUM) ? numblocks*sizeof(CRC_T) : 0;
+}
+
+SIZE_T DiskSystem::GetNumSlotTableBytes() const
+{
+  return (flags & DISKSYSTEM_COMPRESS) ? numblocks*sizeof(CompressedSlot) : 0;
+}
+
+unsigned long long DiskSystem::GetNumStoredBytes() const
+{
+  if (!(flags & DISKSYSTEM_COMPRESS)) { 
+    return (unsigned long long)numblocks*blocksize;
+  }
+  unsigned long long n=0;
+  for (SIZE_T b=0;b<numblocks;b++) { 
+    n+=slots[b].length;
+  }
+  return n;
+}
+
 
 
 #define GETBIT(x) ((bitmap[(x)/8] >> (7-((x)%8))) & 0x1)
-#define SETBIT(x) do { bitmap[(x)/8] |= 0x1 << (7-((x)%8)); } while (0)
-#define CLEARBIT(x) do { bitmap[(x)/8] &= ~(0x1 << (7-((x)%8))); } while (0)
+#define MARKPAGE(x) do { bitmapdirty[(x)/8/DISKSYSTEM_BITMAP_PAGE]=1; } while (0)
+#define SETBIT(x) do { bitmap[(x)/8] |= 0x1 << (7-((x)%8)); MARKPAGE(x); } while (0)
+#define CLEARBIT(x) do { bitmap[(x)/8] &= ~(0x1 << (7-((x)%8))); MARKPAGE(x); } while (0)
 
 
 bool DiskSystem::IsBlockAllocated(const SIZE_T block)
@@ -548,15 +1474,15 @@ ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innum
   return ERROR_NOERROR;
 }
 
-ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innumblocks)
+ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T inoffblock,const SIZE_T innumblocks)
 {
-  if (offset+innumblocks > numblocks) { 
-    cerr << "Disksystem: NotifyDeallocateBlocks: Attempt to deallocate"<<offset<<" to "<<(offset+innumblocks-1)<<" but maximum block is "<<(numblocks-1)<<endl;
+  if (inoffblock+innumblocks > numblocks) { 
+    cerr << "Disksystem: NotifyDeallocateBlocks: Attempt to deallocate"<<inoffblock<<" to "<<(inoffblock+innumblocks-1)<<" but maximum block is "<<(numblocks-1)<<endl;
     return ERROR_NOSUCHBLOCK;
   }
 
 
-  for (SIZE_T i=offset; i<(offset+innumblocks); i++) { 
+  for (SIZE_T i=inoffblock; i<(inoffblock+innumblocks); i++) { 
     if (!IsBlockAllocated(i)) {
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr << "Disksystem: NotifyDeallocateBlocks: Block "<<i<<" is being deallocated, but it's already deallocated!"<<endl;
@@ -565,6 +1491,56 @@ ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innu
     CLEARBIT(i);
   }
 
+  if (flags & DISKSYSTEM_PUNCHHOLES) { 
+    return PunchBlocks(inoffblock,innumblocks);
+  }
+
+  return ERROR_NOERROR;
+}
+
+//
+// Return the storage of deallocated blocks to the filesystem.  The
+// blocks read back as zeros afterwards.  Whoever owns a cached copy
+// of such a block (eg, a dirty free list node in the buffer cache)
+// simply rewrites it, which allocates the space again.
+//
+ERROR_T DiskSystem::PunchBlocks(const SIZE_T inoffblock, const SIZE_T innumblocks)
+{
+  bool punched=false;
+
+  if (flags & DISKSYSTEM_COMPRESS) { 
+    for (SIZE_T i=inoffblock; i<(inoffblock+innumblocks); i++) { 
+      if (slots[i].length==0) { 
+	continue;
+      }
+      SIZE_T n=FragmentsFor(slots[i].length);
+      // The slot is free now regardless of whether the punch works
+      mypunch(datafilefd,offset+(unsigned long long)slots[i].fragment*fragsize,(unsigned long long)n*fragsize);
+      memset(fragmap+slots[i].fragment,0,n);
+      slots[i].length=0;
+      ERROR_T rc=StoreSlot(i);
+      if (rc) { 
+	return rc;
+      }
+    }
+    punched=true;
+  } else {
+    punched=mypunch(datafilefd,
+		    offset+(unsigned long long)inoffblock*blocksize,
+		    (unsigned long long)innumblocks*blocksize);
+  }
+
+  if (punched && (flags & DISKSYSTEM_CHECKSUM)) { 
+    Block zero(blocksize);
+    memset(zero.data,0,blocksize);
+    for (SIZE_T i=inoffblock; i<(inoffblock+innumblocks); i++) { 
+      ERROR_T rc=StampChecksum(i,zero.data);
+      if (rc) { 
+	return rc;
+      }
+    }
+  }
+
   return ERROR_NOERROR;
 }
 
@@ -583,9 +1559,14 @@ ostream & DiskSystem::Print(ostream &os) const
      << ", averageseeklatency="<<averageseeklatency
      << ", trackseeklatency="<<trackseeklatency
      << ", rotationallatency="<<rotationallatency
+     << ", checksums="<<((flags & DISKSYSTEM_CHECKSUM) ? "on" : "off")
+     << ", compression="<<((flags & DISKSYSTEM_COMPRESS) ? "on" : "off")
+     << ", preallocated="<<((flags & DISKSYSTEM_PREALLOC) ? "yes" : "no")
+     << ", punchholes="<<((flags & DISKSYSTEM_PUNCHHOLES) ? "on" : "off")
+     << ", image="<<((flags & DISKSYSTEM_IMAGE) ? "yes" : "no")
      << ", bitmap=";
 
-  for (SIZE_T i=0;i<numblocks;i++) { 
+  for (SIZE_T i=0;bitmap && i<numblocks;i++) { 
     if (GETBIT(i)) { 
       os <<"*";
     } else {
@@ -7,9 +7,70 @@
 
 #include "global.h"
 #include "block.h"
+#include "crc32c.h"
 
 using namespace std;
 
+// Optional features of a disk, fixed when it is created and
+// recorded in its config file
+//
+// DISKSYSTEM_CHECKSUM - keep a CRC32C per block in filestem.checksum,
+//                       stamped on every write and verified on every read
+// DISKSYSTEM_COMPRESS - store each block compressed in a variable size
+//                       slot of the data file, located through the slot
+//                       table in filestem.slots.  Only the bytes actually
+//                       moved are charged in the access time model.
+// DISKSYSTEM_PREALLOC - reserve the whole data file extent at creation
+//                       instead of leaving it sparse
+// DISKSYSTEM_PUNCHHOLES - give the space of deallocated blocks back to
+//                       the filesystem (they read back as zeros)
+#define DISKSYSTEM_CHECKSUM   0x1
+#define DISKSYSTEM_COMPRESS   0x2
+#define DISKSYSTEM_PREALLOC   0x4
+#define DISKSYSTEM_PUNCHHOLES 0x8
+// DISKSYSTEM_IMAGE    - keep everything in the single file filestem.img
+//                       (binary header, bitmap, checksums, slot table,
+//                       data) instead of .config/.bitmap/.data/...
+#define DISKSYSTEM_IMAGE      0x10
+
+// The allocation bitmap is written back in pages of this many bytes,
+// and only pages that have changed since the last flush
+#define DISKSYSTEM_BITMAP_PAGE 512
+
+// Compressed slots are allocated in units of blocksize/this
+#define DISKSYSTEM_FRAGMENTS_PER_BLOCK 8
+
+#define DISKSYSTEM_IMAGE_MAGIC     "BTLABIMG"
+#define DISKSYSTEM_IMAGE_VERSION   1
+// Bytes read when an image is opened; covers the header and metadata
+// of any disk up to several thousand blocks in a single read
+#define DISKSYSTEM_IMAGE_FIRSTREAD 65536
+
+// Fixed header at the start of an image file (native byte order)
+struct DiskImageHeader {
+  char   magic[8];
+  SIZE_T version;
+  SIZE_T numblocks;
+  SIZE_T blocksize;
+  SIZE_T numheads;
+  SIZE_T blockspertrack;
+  SIZE_T numtracks;
+  SIZE_T flags;
+  double averageseeklatency;
+  double trackseeklatency;
+  double rotationallatency;
+  unsigned long long bitmapoffset;
+  unsigned long long checksumoffset;
+  unsigned long long slotoffset;
+  unsigned long long dataoffset;
+};
+
+// Where a block lives in a compressed disk
+struct CompressedSlot {
+  SIZE_T fragment;  // first fragment of the slot
+  SIZE_T length;    // bytes stored (0=never written, blocksize=raw)
+};
+
 // Models a single disk with a single outstanding request
 //
 // Includes storage allocator and free space bitmap to 
@@ -18,9 +79,23 @@ using namespace std;
 class DiskSystem {
  private:
   BYTE_T *bitmap;
+  BYTE_T *bitmapdirty;  // one byte per bitmap page, nonzero if changed
   FILE*  datafilefd;
   FILE*  configfilefd;
   FILE*  bitmapfilefd;
+  CRC_T  *checksums;
+  FILE*  checksumfilefd;
+  CompressedSlot *slots;
+  FILE*  slotfilefd;
+  BYTE_T *fragmap;    // one byte per fragment, nonzero if in use
+  SIZE_T fragsize;
+  SIZE_T numfrags;
+  SIZE_T fragrover;
+  // For an image, the one open file, and where each section starts
+  FILE*  imagefd;
+  unsigned long long bitmapbase;
+  unsigned long long checksumbase;
+  unsigned long long slotbase;
 
 
   //
@@ -35,6 +110,7 @@ class DiskSystem {
   SIZE_T numtracks;
   SIZE_T last_track;
   SIZE_T last_sector;
+  unsigned flags;
     
 
   double averageseeklatency;
@@ -43,19 +119,56 @@ class DiskSystem {
 
  protected:
   virtual double ModelAccess(const SIZE_T off, const SIZE_T num);
+  virtual double ModelAccessBytes(const unsigned long long offbyte, const unsigned long long numbyte);
 
   ERROR_T SanityCheckConfig();
   ERROR_T InitFromConfigFile();
   ERROR_T InitFromInMemoryConfig();
+  ERROR_T LayoutImage(DiskImageHeader &h) const;
+  static bool ImageSectionFits(const DiskImageHeader &h,
+			       const unsigned long long sectionoffset,
+			       const unsigned long long sectionbytes);
+  void    UseImageSections(const DiskImageHeader &h);
+  ERROR_T InitFromImageFile();
+  ERROR_T ReadImageFile();
+  void    AbandonFiles();
+  ERROR_T InitImageFromInMemoryConfig();
   ERROR_T ReadConfig();
   ERROR_T WriteConfig();
+  SIZE_T  NumBitMapBytes() const;
+  SIZE_T  NumBitMapPages() const;
+  void    AllocateBitMap();
   ERROR_T ReadBitMap();
   ERROR_T WriteBitMap();
+  ERROR_T ReadChecksums();
+  ERROR_T WriteChecksums();
+  ERROR_T StampChecksum(const SIZE_T block, const BYTE_T *data);
+  ERROR_T VerifyChecksum(const SIZE_T block, const BYTE_T *data) const;
+
+  unsigned long long DataRegionBytes() const;
+  ERROR_T PunchBlocks(const SIZE_T inoffblock, const SIZE_T innumblocks);
+
+  void    InitCompression();
+  ERROR_T ReadSlots();
+  ERROR_T WriteSlots();
+  ERROR_T StoreSlot(const SIZE_T block);
+  SIZE_T  FragmentsFor(const SIZE_T len) const;
+  ERROR_T CheckSlots();
+  void    RebuildFragmentMap();
+  bool    FindFragments(const SIZE_T num, SIZE_T &start);
+  ERROR_T CompactFragments(double &reqtime);
+  ERROR_T ReadCompressed(const SIZE_T inoffblock, const SIZE_T numblock,
+			 vector<Block> &blocks, double &reqtime);
+  ERROR_T WriteCompressed(const SIZE_T inoffblock, const SIZE_T numblock,
+			  const vector<Block> &blocks, double &reqtime);
   
    
  public:
   // The data is stored in file "filestem.data"
   // The config is stored in file "filestem.config"
+  // The checksums (if enabled) are stored in file "filestem.checksum"
+  // The slot table (if compressed) is stored in file "filestem.slots"
+  // Or, all of the above are in the single file "filestem.img"
 
   DiskSystem(const string &filestem,
 	     const bool create=false,
@@ -67,7 +180,8 @@ class DiskSystem {
 	     const SIZE_T tracks=0,
 	     const double avgseek=0,
 	     const double trackseek=0,
-	     const double rotlat=0);
+	     const double rotlat=0,
+	     const unsigned flags=0);
   DiskSystem() { throw GenericException(); } 
   DiskSystem(const DiskSystem &rhs) { throw GenericException();}
   DiskSystem & operator=(const DiskSystem &rhs) { throw GenericException(); return *this;}
@@ -96,6 +210,13 @@ class DiskSystem {
 
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
+  unsigned GetFlags() const;
+  // Bytes of per-block checksum metadata kept outside the data blocks
+  SIZE_T GetNumChecksumBytes() const;
+  // Bytes of slot table metadata for a compressed disk
+  SIZE_T GetNumSlotTableBytes() const;
+  // Bytes the data blocks actually occupy on the data file
+  unsigned long long GetNumStoredBytes() const;
 
   //
   // These are notification functions that should be called when
@@ -104,11 +225,18 @@ class DiskSystem {
   //
   ERROR_T NotifyAllocateBlocks(const SIZE_T offset,
 			       const SIZE_T innumblocks);
+  // With DISKSYSTEM_PUNCHHOLES, this also releases the blocks' storage
   ERROR_T NotifyDeallocateBlocks(const SIZE_T offset,
 				 const SIZE_T innumblocks);
 
   bool    IsBlockAllocated(const SIZE_T offset);
 
+  // Make the allocation bitmap on disk match memory, writing only
+  // the pages that changed.  This also happens on destruction, but
+  // callers that want allocation state to survive a crash should
+  // flush after allocating or deallocating.
+  ERROR_T FlushBitMap();
+
 
   ostream & Print(ostream &os) const;
 };
@@ -1,8 +1,12 @@
 #!/usr/bin/perl -w
 
-$#ARGV==3 or die "usage: gen_test_sequence.pl keysize valsize seed num\n";
+# mode is one of drain, bloom, varlen, bstar or valuelog, or several
+# of them joined with +, e.g. varlen+valuelog
+($#ARGV==3 || ($#ARGV==4 && $ARGV[4] =~ /^(drain|bloom|varlen|bstar|valuelog)(\+(drain|bloom|varlen|bstar|valuelog))*$/)) or die "usage: gen_test_sequence.pl keysize valsize seed num [drain|bloom|varlen|bstar|valuelog[+...]]\n";
 
-($keysize,$valuesize,$seed,$num)=@ARGV;
+($keysize,$valuesize,$seed,$num,$mode)=@ARGV;
+$mode="" if !defined($mode);
+%modes=map { $_ => 1 } split(/\+/,$mode);
 
 srand $seed;
 
@@ -11,31 +15,44 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 
 %ops = ( INSERT_NEW => \&gen_insert_new,
 	 INSERT_EXISTS => \&gen_insert_exists,
+	 INSERTBATCH => \&gen_insert_batch,
 	 UPDATE_NEW => \&gen_update_new,
 	 UPDATE_EXISTS => \&gen_update_exists,
-#
-# No deletes required this quarter
-# 
-#	 DELETE_NEW => \&gen_delete_new,
-#	 DELETE_EXISTS => \&gen_delete_new,
+	 DELETE_NEW => \&gen_delete_new,
+	 DELETE_EXISTS => \&gen_delete_exists,
 	 LOOKUP_NEW => \&gen_lookup_new,
 	 LOOKUP_EXISTS => \&gen_lookup_exists,
+	 LOOKUPBATCH => \&gen_lookup_batch,
+	 RANGE => \&gen_range,
 	 DISPLAY => \&gen_display
        );
 
 @opnames=keys %ops;
 
+# drain fills the tree for the first half of the sequence and empties
+# it in the second, mostly by deleting the lowest key, which is the
+# hard case for merging and redistribution
+$ops{DELETE_LOWEST} = \&gen_delete_lowest;
+@fillops=(("INSERT_NEW") x 6, "INSERTBATCH", "LOOKUP_EXISTS", "DELETE_EXISTS", "RANGE");
+@drainops=(("DELETE_LOWEST") x 6, "DELETE_EXISTS", "LOOKUP_EXISTS", "LOOKUPBATCH", "INSERT_NEW", "RANGE");
+
 
 %content= ();
 
-print "INIT $keysize $valuesize\n";
+# bloom runs the usual mix on an index with a Bloom filter, which
+# answers most lookups of absent keys (single or batched) by itself.
+# varlen makes keys and values anywhere from 1 byte to their size,
+# with plenty of keys that are prefixes of others.  bstar and valuelog
+# just turn on the index options of the same name.
+print "INIT $keysize $valuesize", (map { " $_" } grep { $modes{$_} } qw(varlen valuelog bloom bstar)), "\n";
 
 for ($i=1;$i<$num;$i++) { 
   # never try to do an existing key if no keys currently exist
   my $numkeys=keys %content;
+  my @choices = !$modes{drain} ? @opnames : $i<$num/2 ? @fillops : @drainops;
   do {
-    $op=$opnames[int(rand($#opnames + 1))];
-  } while ( $op =~ /EXISTS/ && $numkeys<1 );
+    $op=$choices[int(rand($#choices + 1))];
+  } while ( $op =~ /EXISTS|LOWEST/ && $numkeys<1 );
   print &{$ops{$op}}(), "\n";
 }
 
@@ -43,7 +60,20 @@ print "DEINIT\n";
 
 
 sub MakeKey {
-  return join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$keysize));
+  if ($modes{varlen}) {
+    # a quarter of the time, a prefix of a key that's there or a key
+    # that one is a prefix of
+    if (rand(1)<0.25 && keys %content) {
+      my $key=MakeExistentKey();
+      if (rand(1)<0.5 && length($key)>1) {
+	return substr($key,0,1+int(rand(length($key)-1)));
+      } elsif (length($key)<$keysize) {
+	return $key.MakeBytes($keybytes,1+int(rand($keysize-length($key))));
+      }
+    }
+    return MakeBytes($keybytes,1+int(rand($keysize)));
+  }
+  return MakeBytes($keybytes,$keysize);
 }
 
 sub MakeNonExistentKey {
@@ -60,7 +90,12 @@ sub MakeExistentKey {
 }
 
 sub MakeValue {
-  return join("", map { substr($valuebytes,int(rand(length($valuebytes))),1) } (1..$valuesize));
+  return MakeBytes($valuebytes,$modes{varlen} ? 1+int(rand($valuesize)) : $valuesize);
+}
+
+sub MakeBytes {
+  my ($bytes, $len) = @_;
+  return join("", map { substr($bytes,int(rand(length($bytes))),1) } (1..$len));
 }
 
 
@@ -74,6 +109,33 @@ sub gen_insert_exists {
   return "INSERT ".MakeExistentKey()." ".MakeValue()."  # should fail";
 }
 
+# Mostly new keys, some already there, and now and then one given
+# twice in the batch (only the first of those goes in)
+sub gen_insert_batch {
+  my @pairs=();
+  my @should=();
+  for (1..1+int(rand(8))) {
+    my $r=rand(1);
+    my ($key, $value);
+    if ($r<0.15 && @pairs) {
+      $key=$pairs[int(rand($#pairs+1))]->[0];
+    } elsif ($r<0.3 && keys %content) {
+      $key=MakeExistentKey();
+    } else {
+      $key=MakeNonExistentKey();
+    }
+    $value=MakeValue();
+    push @pairs, [$key, $value];
+    if (defined $content{$key}) {
+      push @should, "fail";
+    } else {
+      $content{$key}=$value;
+      push @should, "succeed";
+    }
+  }
+  return "INSERTBATCH ".join(" ", map { "$_->[0] $_->[1]" } @pairs)."  # should ".join(",",@should);
+}
+
 sub gen_update_new {
   return "UPDATE ".MakeNonExistentKey()." ".MakeValue()."  # should fail";
 }
@@ -94,6 +156,18 @@ sub gen_delete_exists {
   return "DELETE $key  # should succeed";
 }
 
+sub gen_delete_lowest {
+  my $key;
+  do {
+    # keys inserted since the order was taken aren't in it, so it is
+    # taken again when it runs out
+    @draining=sort keys %content if !@draining;
+    $key=shift @draining;
+  } while (!defined $content{$key});
+  delete $content{$key};
+  return "DELETE $key  # should succeed";
+}
+
 sub gen_lookup_new {
   return "LOOKUP ".MakeNonExistentKey()."  # should fail";
 }
@@ -103,6 +177,28 @@ sub gen_lookup_exists {
   return "LOOKUP $key  # should succeed and return $content{$key}";
 }
 
+# Keys that are there and keys that aren't, the same one now and then
+# more than once
+sub gen_lookup_batch {
+  my @keys=();
+  for (1..1+int(rand(8))) {
+    my $r=rand(1);
+    if ($r<0.1 && @keys) {
+      push @keys, $keys[int(rand($#keys+1))];
+    } elsif ($r<0.6 && keys %content) {
+      push @keys, MakeExistentKey();
+    } else {
+      push @keys, MakeNonExistentKey();
+    }
+  }
+  return "LOOKUPBATCH ".join(" ",@keys)."  # should return ".join(",", map { defined $content{$_} ? $content{$_} : "fail" } @keys);
+}
+
+sub gen_range {
+  my ($low, $high) = sort (MakeKey(), MakeKey());
+  return "RANGE $low $high  # should always succeed";
+}
+
 sub gen_display {
   return "DISPLAY  # should always succeed";
 }
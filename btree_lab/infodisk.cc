@@ -22,6 +22,16 @@ int main(int argc, char *argv[])
   
   cerr << "Disk is as follows.\n" << disk << "\n";
 
+  SIZE_T databytes=disk.GetNumBlocks()*disk.GetBlockSize();
+
+  cerr << "Checksum metadata: "<<disk.GetNumChecksumBytes()<<" bytes ("
+       << (100.0*disk.GetNumChecksumBytes())/databytes<<"% of "<<databytes<<" data bytes)\n";
+
+  if (disk.GetFlags() & DISKSYSTEM_COMPRESS) { 
+    cerr << "Compressed storage: "<<disk.GetNumStoredBytes()<<" bytes stored for "
+	 <<databytes<<" logical bytes, plus "<<disk.GetNumSlotTableBytes()<<" bytes of slot table\n";
+  }
+
   cerr << "Done.\n";
 
   return 0;
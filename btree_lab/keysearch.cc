@@ -0,0 +1,439 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+#include "keysearch.h"
+
+// Once the candidate range is this small the SIMD kernels finish it
+// with a single vector compare
+#define KEYSEARCH_LANES32 8
+#define KEYSEARCH_LANES64 4
+
+// Interpolation search guesses at most this many times, and stops
+// guessing once the range is this small
+#define KEYSEARCH_MAXGUESSES 4
+#define KEYSEARCH_GUESSKEYS 16
+
+
+static inline unsigned int LoadBE32(const char *p)
+{
+  unsigned int v;
+  memcpy(&v,p,4);
+  return __builtin_bswap32(v);
+}
+
+static inline unsigned long long LoadBE64(const char *p)
+{
+  unsigned long long v;
+  memcpy(&v,p,8);
+  return __builtin_bswap64(v);
+}
+
+
+// 16 byte keys as a (high,low) pair of big-endian words
+static inline bool Before128(const char *p, unsigned long long khi,
+			     unsigned long long klo, const bool upper)
+{
+  unsigned long long hi=LoadBE64(p);
+  if (hi!=khi) {
+    return hi<khi;
+  }
+  return upper ? LoadBE64(p+8)<=klo : LoadBE64(p+8)<klo;
+}
+
+
+// memcmp over keysize bytes, 16 bytes per step where SSE2 is available
+static inline int CompareBytes(const char *a, const char *b, SIZE_T len)
+{
+#if HAVE_X86_SIMD
+  while (len>=16) {
+    __m128i x=_mm_loadu_si128((const __m128i*)a);
+    __m128i y=_mm_loadu_si128((const __m128i*)b);
+    unsigned diff=~_mm_movemask_epi8(_mm_cmpeq_epi8(x,y)) & 0xffff;
+    if (diff) {
+      unsigned i=__builtin_ctz(diff);
+      return (int)(unsigned char)a[i]-(int)(unsigned char)b[i];
+    }
+    a+=16;
+    b+=16;
+    len-=16;
+  }
+#endif
+  return len ? memcmp(a,b,len) : 0;
+}
+
+
+// Scalar kernels: a plain lower/upper bound binary search.  Before(i)
+// is true when key i belongs before the search position.
+#define BINARY_SEARCH(BEFORE)				\
+  SIZE_T lo=0;						\
+  while (n>0) {						\
+    SIZE_T half=n/2;					\
+    if (BEFORE(lo+half)) {				\
+      lo+=half+1;					\
+      n-=half+1;					\
+    } else {						\
+      n=half;						\
+    }							\
+  }							\
+  return lo;
+
+
+static SIZE_T SearchScalar(const char *base, const SIZE_T stride,
+			   const SIZE_T keysize, SIZE_T n,
+			   const char *key, const bool upper)
+{
+  int limit=upper ? 0 : -1;
+#define BEFORE(i) (CompareBytes(base+(i)*stride,key,keysize)<=limit)
+  BINARY_SEARCH(BEFORE)
+#undef BEFORE
+}
+
+
+static SIZE_T SearchScalar32(const char *base, const SIZE_T stride,
+			     const SIZE_T keysize, SIZE_T n,
+			     const char *key, const bool upper)
+{
+  unsigned int k=LoadBE32(key);
+#define BEFORE(i) (upper ? LoadBE32(base+(i)*stride)<=k : LoadBE32(base+(i)*stride)<k)
+  BINARY_SEARCH(BEFORE)
+#undef BEFORE
+}
+
+
+static SIZE_T SearchScalar64(const char *base, const SIZE_T stride,
+			     const SIZE_T keysize, SIZE_T n,
+			     const char *key, const bool upper)
+{
+  unsigned long long k=LoadBE64(key);
+#define BEFORE(i) (upper ? LoadBE64(base+(i)*stride)<=k : LoadBE64(base+(i)*stride)<k)
+  BINARY_SEARCH(BEFORE)
+#undef BEFORE
+}
+
+
+static SIZE_T SearchScalar128(const char *base, const SIZE_T stride,
+			      const SIZE_T keysize, SIZE_T n,
+			      const char *key, const bool upper)
+{
+  unsigned long long khi=LoadBE64(key), klo=LoadBE64(key+8);
+#define BEFORE(i) Before128(base+(i)*stride,khi,klo,upper)
+  BINARY_SEARCH(BEFORE)
+#undef BEFORE
+}
+
+
+#if HAVE_X86_SIMD
+
+// Narrow [lo,lo+n) with scalar probes until at most lanes keys are
+// left; the caller then compares all of them at once
+#define NARROW(BEFORE,LANES)			\
+  SIZE_T lo=0;					\
+  while (n>(LANES)) {				\
+    SIZE_T half=n/2;				\
+    if (BEFORE(lo+half)) {			\
+      lo+=half+1;				\
+      n-=half+1;				\
+    } else {					\
+      n=half;					\
+    }						\
+  }						\
+  if (n==0) {					\
+    return lo;					\
+  }
+
+
+// Byte offsets of keys lo..lo+lanes-1; lanes past the end repeat the
+// last valid key so the gathers stay inside the node
+__attribute__((target("avx2")))
+static inline __m256i GatherOffsets(SIZE_T lo, SIZE_T n, SIZE_T stride)
+{
+  __m256i lane=_mm256_setr_epi32(0,1,2,3,4,5,6,7);
+  __m256i idx=_mm256_min_epi32(lane,_mm256_set1_epi32(n-1));
+  return _mm256_mullo_epi32(_mm256_add_epi32(idx,_mm256_set1_epi32(lo)),
+			    _mm256_set1_epi32(stride));
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T SearchAVX2_32(const char *base, const SIZE_T stride,
+			    const SIZE_T keysize, SIZE_T n,
+			    const char *key, const bool upper)
+{
+  unsigned int k=LoadBE32(key);
+#define BEFORE(i) (upper ? LoadBE32(base+(i)*stride)<=k : LoadBE32(base+(i)*stride)<k)
+  NARROW(BEFORE,KEYSEARCH_LANES32)
+#undef BEFORE
+
+  const __m256i bswap=_mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+				       3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  const __m256i sign=_mm256_set1_epi32(0x80000000);
+
+  __m256i keys=_mm256_i32gather_epi32((const int*)base,GatherOffsets(lo,n,stride),1);
+  keys=_mm256_xor_si256(_mm256_shuffle_epi8(keys,bswap),sign);
+  __m256i target=_mm256_xor_si256(_mm256_set1_epi32(k),sign);
+
+  // upper: key<=k is !(key>k); lower: key<k
+  __m256i before=upper ? _mm256_cmpgt_epi32(keys,target) : _mm256_cmpgt_epi32(target,keys);
+  unsigned mask=_mm256_movemask_ps(_mm256_castsi256_ps(before));
+  if (upper) {
+    mask=~mask;
+  }
+  return lo+__builtin_popcount(mask & ((1u<<n)-1));
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i GatherBE64(const char *base, __m128i offsets)
+{
+  const __m256i bswap=_mm256_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+				       7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  const __m256i sign=_mm256_set1_epi64x(0x8000000000000000LL);
+
+  __m256i v=_mm256_i32gather_epi64((const long long*)base,offsets,1);
+  return _mm256_xor_si256(_mm256_shuffle_epi8(v,bswap),sign);
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T SearchAVX2_64(const char *base, const SIZE_T stride,
+			    const SIZE_T keysize, SIZE_T n,
+			    const char *key, const bool upper)
+{
+  unsigned long long k=LoadBE64(key);
+#define BEFORE(i) (upper ? LoadBE64(base+(i)*stride)<=k : LoadBE64(base+(i)*stride)<k)
+  NARROW(BEFORE,KEYSEARCH_LANES64)
+#undef BEFORE
+
+  __m128i offsets=_mm256_castsi256_si128(GatherOffsets(lo,n,stride));
+  __m256i keys=GatherBE64(base,offsets);
+  __m256i target=_mm256_set1_epi64x((long long)(k^0x8000000000000000ULL));
+
+  __m256i before=upper ? _mm256_cmpgt_epi64(keys,target) : _mm256_cmpgt_epi64(target,keys);
+  unsigned mask=_mm256_movemask_pd(_mm256_castsi256_pd(before));
+  if (upper) {
+    mask=~mask;
+  }
+  return lo+__builtin_popcount(mask & ((1u<<n)-1));
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T SearchAVX2_128(const char *base, const SIZE_T stride,
+			     const SIZE_T keysize, SIZE_T n,
+			     const char *key, const bool upper)
+{
+  unsigned long long khi=LoadBE64(key), klo=LoadBE64(key+8);
+#define BEFORE(i) Before128(base+(i)*stride,khi,klo,upper)
+  NARROW(BEFORE,KEYSEARCH_LANES64)
+#undef BEFORE
+
+  __m128i offsets=_mm256_castsi256_si128(GatherOffsets(lo,n,stride));
+  __m256i hi=GatherBE64(base,offsets);
+  __m256i lo8=GatherBE64(base+8,offsets);
+  __m256i thi=_mm256_set1_epi64x((long long)(khi^0x8000000000000000ULL));
+  __m256i tlo=_mm256_set1_epi64x((long long)(klo^0x8000000000000000ULL));
+
+  // Lexicographic on (hi,lo).  upper: !(key>k); lower: key<k
+  __m256i a=upper ? hi : thi, b=upper ? thi : hi;
+  __m256i c=upper ? lo8 : tlo, d=upper ? tlo : lo8;
+  __m256i gt=_mm256_or_si256(_mm256_cmpgt_epi64(a,b),
+			     _mm256_and_si256(_mm256_cmpeq_epi64(hi,thi),
+					      _mm256_cmpgt_epi64(c,d)));
+  unsigned mask=_mm256_movemask_pd(_mm256_castsi256_pd(gt));
+  if (upper) {
+    mask=~mask;
+  }
+  return lo+__builtin_popcount(mask & ((1u<<n)-1));
+}
+
+#endif
+
+
+static bool HaveAVX2()
+{
+#if HAVE_X86_SIMD
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+
+KeySearchFunc GetKeySearch(const SIZE_T keysize)
+{
+  static bool avx2=HaveAVX2();
+
+  switch (keysize) {
+  case 4:
+#if HAVE_X86_SIMD
+    if (avx2) { return SearchAVX2_32; }
+#endif
+    return SearchScalar32;
+  case 8:
+#if HAVE_X86_SIMD
+    if (avx2) { return SearchAVX2_64; }
+#endif
+    return SearchScalar64;
+  case 16:
+#if HAVE_X86_SIMD
+    if (avx2) { return SearchAVX2_128; }
+#endif
+    return SearchScalar128;
+  default:
+    return SearchScalar;
+  }
+}
+
+
+// True when the key at p sorts before the search position for key
+template <SIZE_T W>
+static inline bool KeyBefore(const char *p, const char *key, const bool upper)
+{
+  int c=memcmp(p,key,W);
+  return upper ? c<=0 : c<0;
+}
+
+template <>
+inline bool KeyBefore<4>(const char *p, const char *key, const bool upper)
+{
+  unsigned int a=LoadBE32(p), b=LoadBE32(key);
+  return upper ? a<=b : a<b;
+}
+
+template <>
+inline bool KeyBefore<8>(const char *p, const char *key, const bool upper)
+{
+  unsigned long long a=LoadBE64(p), b=LoadBE64(key);
+  return upper ? a<=b : a<b;
+}
+
+template <>
+inline bool KeyBefore<16>(const char *p, const char *key, const bool upper)
+{
+  unsigned long long a=LoadBE64(p), b=LoadBE64(key);
+  if (a!=b) {
+    return a<b;
+  }
+  return KeyBefore<8>(p+8,key+8,upper);
+}
+
+
+// Probe with the inlined compare until only a handful of keys are
+// left, then let the runtime kernel for W (SIMD where available)
+// finish those
+template <SIZE_T W>
+static SIZE_T SearchFixed(const char *base, const SIZE_T stride,
+			  const SIZE_T keysize, SIZE_T n,
+			  const char *key, const bool upper)
+{
+  static const KeySearchFunc tail=GetKeySearch(W);
+  const SIZE_T tailkeys = W==4 ? KEYSEARCH_LANES32 : KEYSEARCH_LANES64;
+  SIZE_T lo=0;
+
+  while (n>tailkeys) {
+    SIZE_T half=n/2;
+    if (KeyBefore<W>(base+(lo+half)*stride,key,upper)) {
+      lo+=half+1;
+      n-=half+1;
+    } else {
+      n=half;
+    }
+  }
+  return lo+tail(base+lo*stride,stride,W,n,key,upper);
+}
+
+
+KeySearchFunc GetKeySearchFixed(const SIZE_T width)
+{
+  static const KeySearchFunc fixed[KEYSEARCH_MAXFIXED+1] = {
+    0,
+    SearchFixed<1>,  SearchFixed<2>,  SearchFixed<3>,  SearchFixed<4>,
+    SearchFixed<5>,  SearchFixed<6>,  SearchFixed<7>,  SearchFixed<8>,
+    SearchFixed<9>,  SearchFixed<10>, SearchFixed<11>, SearchFixed<12>,
+    SearchFixed<13>, SearchFixed<14>, SearchFixed<15>, SearchFixed<16>,
+  };
+
+  if (width>=1 && width<=KEYSEARCH_MAXFIXED) {
+    return fixed[width];
+  }
+  return GetKeySearch(width);
+}
+
+
+static inline unsigned long long LoadU64(const char *base, const SIZE_T i)
+{
+  unsigned long long v;
+  memcpy(&v,base+i*8,8);
+  return v;
+}
+
+static inline bool IntBefore(const unsigned long long v,
+			     const unsigned long long key, const bool upper)
+{
+  return upper ? v<=key : v<key;
+}
+
+
+// First offset in [lo,hi) whose value is not before key, hi if none
+static SIZE_T IntSearchRange(const char *base, SIZE_T lo, SIZE_T hi,
+			     const unsigned long long key, const bool upper)
+{
+  while (lo<hi) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (IntBefore(LoadU64(base,mid),key,upper)) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+SIZE_T IntSearchBinary(const char *base, const SIZE_T n,
+		       const unsigned long long key, const bool upper)
+{
+  return IntSearchRange(base,0,n,key,upper);
+}
+
+
+SIZE_T IntSearchInterpolation(const char *base, const SIZE_T n,
+			      const unsigned long long key, const bool upper)
+{
+  // The answer is always in [lo,hi]
+  SIZE_T lo=0, hi=n;
+
+  for (int guess=0; guess<KEYSEARCH_MAXGUESSES && hi-lo>KEYSEARCH_GUESSKEYS; guess++) {
+    unsigned long long first=LoadU64(base,lo);
+    unsigned long long last=LoadU64(base,hi-1);
+    if (!IntBefore(first,key,upper)) {
+      return lo;
+    }
+    if (IntBefore(last,key,upper)) {
+      return hi;
+    }
+    // first <= key <= last and first < last, so the answer is in
+    // (lo,hi-1]; probe strictly inside that
+    SIZE_T pos=lo+(SIZE_T)((long double)(key-first)/(long double)(last-first)*(hi-1-lo));
+    if (pos<lo+1) {
+      pos=lo+1;
+    } else if (pos>hi-2) {
+      pos=hi-2;
+    }
+    if (IntBefore(LoadU64(base,pos),key,upper)) {
+      lo=pos+1;
+      hi=hi-1;
+    } else {
+      lo=lo+1;
+      hi=pos;
+    }
+  }
+  return IntSearchRange(base,lo,hi,key,upper);
+}
@@ -0,0 +1,61 @@
+#ifndef _keysearch
+#define _keysearch
+
+#include "global.h"
+
+// In-node search over n fixed-size keys sorted in memcmp order.
+// Key i starts at base+i*stride.  Nodes keep their keys in one
+// contiguous array, so there stride is just the key width.
+//
+// Returns the number of keys that are < key, or <= key when upper is
+// true; i.e. the lower or upper bound offset.
+//
+// 4, 8 and 16 byte keys get kernels that load keys as big-endian
+// integers; with AVX2 the final few candidates are compared several
+// at a time with gathers.  Other sizes use a binary search whose key
+// comparison works 16 bytes at a time.  The CPU is probed once and
+// every path gives identical results.
+typedef SIZE_T (*KeySearchFunc)(const char *base, const SIZE_T stride,
+				const SIZE_T keysize, const SIZE_T n,
+				const char *key, const bool upper);
+
+// The best kernel for this keysize on this CPU
+KeySearchFunc GetKeySearch(const SIZE_T keysize);
+
+inline SIZE_T KeySearch(const char *base, const SIZE_T stride,
+			const SIZE_T keysize, const SIZE_T n,
+			const char *key, const bool upper)
+{
+  return GetKeySearch(keysize)(base,stride,keysize,n,key,upper);
+}
+
+
+// Widths up to this get a compile-time specialized kernel
+#define KEYSEARCH_MAXFIXED 16
+
+// Kernel specialized at compile time for keys of exactly width bytes
+// (the compare is inlined with constant length); falls back to
+// GetKeySearch for widths without a specialization.  Nodes whose
+// stored key width varies (prefix compression) pick one of these per
+// node from a table built once per index.
+KeySearchFunc GetKeySearchFixed(const SIZE_T width);
+
+
+// Search over n native-endian unsigned 64 bit integers starting at
+// base (no alignment needed), for indexes whose keys are stored as
+// integers.  Same result as a KeySearchFunc.
+typedef SIZE_T (*IntSearchFunc)(const char *base, const SIZE_T n,
+				const unsigned long long key, const bool upper);
+
+// Plain binary search
+SIZE_T IntSearchBinary(const char *base, const SIZE_T n,
+		       const unsigned long long key, const bool upper);
+
+// Guesses where key falls from the values at either end of the range
+// and narrows it around the guess; a few probes for evenly spread
+// keys.  Gives up on guessing after a few rounds (badly skewed keys)
+// and finishes with a binary search.
+SIZE_T IntSearchInterpolation(const char *base, const SIZE_T n,
+			      const unsigned long long key, const bool upper);
+
+#endif
@@ -1,12 +1,19 @@
 #include <string>
 #include <stdlib.h>
+#include <string.h>
 
 #include "disksystem.h"
 
 
 void usage() 
 {
-  cerr << "usage: makedisk filestem blocks blocksize heads blockspertrack tracks avgseek trackseek rotlat\n";
+  cerr << "usage: makedisk filestem blocks blocksize heads blockspertrack tracks avgseek trackseek rotlat [options]\n";
+  cerr << "options:\n";
+  cerr << "  -checksum   keep a CRC32C checksum per block, verified on every read\n";
+  cerr << "  -compress   store blocks compressed in variable size slots\n";
+  cerr << "  -prealloc   reserve the full data file extent now\n";
+  cerr << "  -punch      release the storage of deallocated blocks\n";
+  cerr << "  -image      keep the whole disk in the single file filestem.img\n";
 }
 
 int main(int argc, char *argv[])
@@ -16,6 +23,25 @@ int main(int argc, char *argv[])
     exit(-1);
   }
 
+  unsigned flags=0;
+
+  for (int i=10;i<argc;i++) { 
+    if (!strcmp(argv[i],"-checksum")) { 
+      flags|=DISKSYSTEM_CHECKSUM;
+    } else if (!strcmp(argv[i],"-compress")) { 
+      flags|=DISKSYSTEM_COMPRESS;
+    } else if (!strcmp(argv[i],"-prealloc")) { 
+      flags|=DISKSYSTEM_PREALLOC;
+    } else if (!strcmp(argv[i],"-punch")) { 
+      flags|=DISKSYSTEM_PUNCHHOLES;
+    } else if (!strcmp(argv[i],"-image")) { 
+      flags|=DISKSYSTEM_IMAGE;
+    } else {
+      usage();
+      exit(-1);
+    }
+  }
+
   DiskSystem disk(argv[1],
 		  true,
 		  0,
@@ -26,7 +52,8 @@ int main(int argc, char *argv[])
 		  atoi(argv[6]),
 		  atof(argv[7]),
 		  atof(argv[8]),
-		  atof(argv[9]));
+		  atof(argv[9]),
+		  flags);
   
   
   cerr << "Disk is as follows.\n" << disk << "\n";
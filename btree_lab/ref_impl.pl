@@ -33,6 +33,22 @@ while ($line=<STDIN>) {
       print STDERR "Inserted ($key, $value)\n" if $debug;
       print "OK\n";
     }
+  } elsif ($op eq "INSERTBATCH") { 
+    # pairs up to the end of the line or a comment, inserted in order
+    @args=split(/\s+/,$rest);
+    print "OK BEGIN INSERTBATCH\n";
+    while ($#args>=1 && $args[0] !~ /^#/) {
+      ($key, $value) = splice(@args,0,2);
+      if (defined $content{$key} || Bug()) { 
+	print STDERR "Batch inserting ($key, $value) failed because $key already exists\n" if $debug;
+	print "FAIL\n";
+      } else {
+	$content{$key}=$value;
+	print STDERR "Batch inserted ($key, $value)\n" if $debug;
+	print "OK\n";
+      }
+    }
+    print "OK END INSERTBATCH\n";
   } elsif ($op eq "UPDATE") { 
     ($key, $value) = split(/\s+/,$rest);
     if (!(defined $content{$key}) || Bug()) { 
@@ -63,6 +79,30 @@ while ($line=<STDIN>) {
       print STDERR "Lookup ($key) found $value\n" if $debug;
       print "OK $value\n";
     }
+  } elsif ($op eq "LOOKUPBATCH") { 
+    # keys up to the end of the line or a comment
+    @args=split(/\s+/,$rest);
+    print "OK BEGIN LOOKUPBATCH\n";
+    while (@args && $args[0] !~ /^#/) {
+      $key=shift @args;
+      if (!(defined $content{$key}) || Bug() ) { 
+	print STDERR "Batch looking up ($key) failed because $key does not exist\n" if $debug;
+	print "FAIL\n";
+      } else {
+	$value= $content{$key};
+	print STDERR "Batch lookup ($key) found $value\n" if $debug;
+	print "OK $value\n";
+      }
+    }
+    print "OK END LOOKUPBATCH\n";
+  } elsif ($op eq "RANGE") { 
+    ($low, $high)=split(/\s+/,$rest);
+    print STDERR "Displaying content in [$low, $high)\n" if $debug;
+    print "OK BEGIN RANGE\n";
+    foreach $key (sort keys %content) {
+      print "($key, $content{$key})\n" if $key ge $low && $key lt $high;
+    }
+    print "OK END RANGE\n";
   } elsif ($op eq "DISPLAY") { 
     print STDERR "Displaying content in sorted order\n" if $debug;
     print "OK BEGIN DISPLAY\n";
@@ -30,8 +30,8 @@ int main(int argc, char *argv[])
   SIZE_T superblocknum;
 
   FILE *file; 
-  char line[1024];
-  int max = 8192;
+  char line[8192];
+  int max = sizeof(line);
   ERROR_T rc;
   
   // We'll connect to the btree only once and then
@@ -59,7 +59,24 @@ int main(int argc, char *argv[])
     is >> action >> key >> value;
 
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+      SIZE_T flags=0;
+      string option;
+      while (is >> option) {
+	if (option == "varlen") {
+	  flags|=BTREE_VARLEN;
+	} else if (option == "int") {
+	  flags|=BTREE_INTKEYS;
+	} else if (option == "interpolate") {
+	  flags|=BTREE_INTERPOLATE;
+	} else if (option == "valuelog") {
+	  flags|=BTREE_VALUELOG;
+	} else if (option == "bloom") {
+	  flags|=BTREE_BLOOM;
+	} else if (option == "bstar") {
+	  flags|=BTREE_BSTAR;
+	}
+      }
+      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache,true,flags);
       if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
@@ -73,6 +90,31 @@ int main(int argc, char *argv[])
       } else {
         cout <<"OK\n";
       }
+    } else if (action == "INSERTBATCH"){
+      // key value key value ... up to the end of the line or a comment
+      istrstream args(line2.c_str(),line2.size());
+      string batch_key, batch_value;
+      vector<KeyValuePair> pairs;
+      vector<ERROR_T> results;
+      args >> action;
+      while (args >> batch_key && batch_key[0]!='#' && args >> batch_value) {
+	pairs.push_back(KeyValuePair(KEY_T(batch_key.c_str()),VALUE_T(batch_value.c_str())));
+      }
+      if ((rc=btree->InsertBatch(pairs,results))!=ERROR_NOERROR) {
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't insert batch due to error "<<rc<<"\n";
+      } else {
+	cout <<"OK BEGIN INSERTBATCH\n";
+	for (unsigned int i=0; i<results.size(); i++) {
+	  if (results[i]!=ERROR_NOERROR) {
+	    cout <<"FAIL\n";
+	    cerr <<"Can't insert pair "<<i<<" of batch due to error "<<results[i]<<"\n";
+	  } else {
+	    cout <<"OK\n";
+	  }
+	}
+	cout <<"OK END INSERTBATCH\n";
+      }
     } else if (action == "UPDATE"){
       if ((rc=btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
         cout <<"FAIL" <<endl;
@@ -99,6 +141,59 @@ int main(int argc, char *argv[])
 	}
  	cout << endl;
       }
+    } else if (action == "LOOKUPBATCH"){
+      // key key ... up to the end of the line or a comment
+      istrstream args(line2.c_str(),line2.size());
+      string batch_key;
+      vector<KEY_T> keys;
+      vector<VALUE_T> values;
+      vector<ERROR_T> results;
+      args >> action;
+      while (args >> batch_key && batch_key[0]!='#') {
+	keys.push_back(KEY_T(batch_key.c_str()));
+      }
+      if ((rc=btree->LookupBatch(keys,values,results))!=ERROR_NOERROR) {
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't lookup batch due to error "<<rc<<"\n";
+      } else {
+	cout <<"OK BEGIN LOOKUPBATCH\n";
+	for (unsigned int i=0; i<results.size(); i++) {
+	  if (results[i]!=ERROR_NOERROR) {
+	    cout <<"FAIL\n";
+	    cerr <<"Can't lookup key "<<i<<" of batch due to error "<<results[i]<<"\n";
+	  } else {
+	    cout <<"OK ";
+	    for (unsigned int k=0; k<values[i].length; k++) {
+	      cout << values[i].data[k];
+	    }
+	    cout <<"\n";
+	  }
+	}
+	cout <<"OK END LOOKUPBATCH\n";
+      }
+    } else if (action == "RANGE") {
+      BTreeCursor cursor(*btree);
+      KEY_T range_key;
+      VALUE_T range_value;
+      if ((rc=cursor.Seek(KEY_T(key.c_str())))!=ERROR_NOERROR ||
+	  (rc=cursor.SetLimit(KEY_T(value.c_str())))!=ERROR_NOERROR) {
+	cout <<"FAIL"<< endl;
+	cerr <<"Can't scan range due to error "<<rc<<endl;
+      } else {
+	cout <<"OK BEGIN RANGE\n";
+	while ((rc=cursor.Next(range_key,range_value))==ERROR_NOERROR) {
+	  cout << "(";
+	  for (unsigned int k=0; k<range_key.length; k++) {
+	    cout << range_key.data[k];
+	  }
+	  cout << ",";
+	  for (unsigned int k=0; k<range_value.length; k++) {
+	    cout << range_value.data[k];
+	  }
+	  cout << ")\n";
+	}
+	cout <<"OK END RANGE\n";
+      }
     } else if (action == "DISPLAY") {
       // This should always be OK
       cout <<"OK BEGIN DISPLAY\n";
@@ -16,17 +16,35 @@ $cachesize=64;
 
 $maxerr=10;
 
-$#ARGV==3 or die "usage: test_me.pl keysize valuesize seed numops\n";
-
-($keysize,$valuesize,$seed,$numops)=@ARGV;
+# anything after numops that starts with - goes to makedisk (-checksum,
+# -compress, -punch, -image), anything else is the gen_test_sequence.pl
+# mode
+$usage="usage: test_me.pl keysize valuesize seed numops [drain|bloom|varlen|bstar|valuelog[+...]] [makedisk options]\n";
+
+$#ARGV>=3 or die $usage;
+
+($keysize,$valuesize,$seed,$numops,@rest)=@ARGV;
+@diskopts=grep { /^-/ } @rest;
+@modes=grep { !/^-/ } @rest;
+$#modes<=0 or die $usage;
+$mode=$#modes==0 ? $modes[0] : "";
+$mode eq "" || $mode =~ /^(drain|bloom|varlen|bstar|valuelog)(\+(drain|bloom|varlen|bstar|valuelog))*$/ or die $usage;
+
+# drain fills the tree and then deletes nearly everything, lowest key
+# first.  Small blocks make for many merges and redistributions.
+if ($mode =~ /drain/) {
+  $numblocks=4096;
+  $blocksize=512;
+  $blockspertrack=4096;
+}
 
 $ENV{PATH}.=":.";
 
 system "deletedisk $diskstem";
-system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat";
+system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat @diskopts";
 
 
-$cmd="test.pl \"ref_impl.pl nodebug 0\" \"sim $diskstem $cachesize\" $keysize $valuesize $seed $numops $maxerr";
+$cmd="test.pl \"ref_impl.pl nodebug 0\" \"sim $diskstem $cachesize\" $keysize $valuesize $seed $numops $maxerr $mode";
 
 system $cmd;
 